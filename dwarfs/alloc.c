@@ -1,5 +1,14 @@
 #include <linux/buffer_head.h>
 #include <linux/limits.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/blkdev.h>
+#include <linux/sched/signal.h>
 
 #include "dwarfs.h"
 
@@ -12,41 +21,68 @@ static inline void dwarfs_flip_bitmap(unsigned long *bitmap, __le64 blocknum) {
     test_and_change_bit(blocknum, bitmap);
 }
 
-int64_t dwarfs_inode_alloc(struct super_block *sb) {
-    struct buffer_head *bmbh = NULL;
+/*
+ * Take the first free inode at or after bit from of an inode bitmap block.
+ * The inode bitmap lock must be held. Returns -ENOSPC if there is none.
+ */
+static int64_t dwarfs_inode_alloc_from(struct super_block *sb, uint64_t bitmapblock, unsigned long from) {
     struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
     struct dwarfs_superblock *dfsb = dfsb_i->dfsb;
-    int64_t ino = 0;
-    int64_t bitmapblock = -1;
-
-    do {
-	mutex_lock_interruptible(&dfsb_i->dwarfs_inode_bitmap_lock);
-        bitmapblock++;
-        ino = 0;
-        if(!(bmbh = sb_bread(sb, dfsb->dwarfs_inode_bitmap_start + bitmapblock))) {
-            printk("Dwarfs: Unable to read inode bitmap\n");
-            mutex_unlock(&dfsb_i->dwarfs_inode_bitmap_lock);
-            return -EIO;
-        }
-        ino = find_next_zero_bit_le((unsigned long *)bmbh->b_data, sb->s_blocksize, ino);
-        if(ino + bitmapblock * sb->s_blocksize > dfsb->dwarfs_inodec) {
-            printk("Dwarfs: No free inodes! %lld > %llu\n", ino + bitmapblock * sb->s_blocksize, dfsb->dwarfs_inodec);
-            brelse(bmbh);
-            mutex_unlock(&dfsb_i->dwarfs_inode_bitmap_lock);
-            return -ENOSPC;
-        }
-	if(ino < sb->s_blocksize)
-	    break;
-	brelse(bmbh);
-	mutex_unlock(&dfsb_i->dwarfs_inode_bitmap_lock);
-    } while(ino >= sb->s_blocksize);
-    dwarfs_flip_bitmap((unsigned long *)bmbh->b_data, ino);
-    dfsb_i->dwarfs_free_inodes_count--;
+    struct buffer_head *bmbh = NULL;
+    uint64_t bits = dwarfs_bitmap_bits(sb);
+    uint64_t validbits = min_t(uint64_t, bits, dfsb->dwarfs_inodec - bitmapblock * bits);
+    unsigned long ino;
 
+    if(!(bmbh = sb_bread(sb, dfsb->dwarfs_inode_bitmap_start + bitmapblock))) {
+        printk("Dwarfs: Unable to read inode bitmap\n");
+        return -EIO;
+    }
+    ino = find_next_zero_bit_le((unsigned long *)bmbh->b_data, validbits, from);
+    if(ino >= validbits) {
+        if(!from && bitmapblock == dfsb_i->dwarfs_inode_first_free)
+            dfsb_i->dwarfs_inode_first_free++;
+        brelse(bmbh);
+        return -ENOSPC;
+    }
+    dwarfs_flip_bitmap((unsigned long *)bmbh->b_data, ino);
+    percpu_counter_dec(&dfsb_i->dwarfs_free_inodes_count);
     dwarfs_write_buffer(&bmbh, sb);
+    return ino + bits * bitmapblock;
+}
+
+/*
+ * Allocate an inode for a new node of the given mode in directory dir.
+ * Files are placed at the first free inode after their directory, so the inodes of a
+ * directory end up in the same few inode table blocks. New directories go to the next-fit
+ * cursor instead, which starts every directory on a fresh inode table block to leave room
+ * for its files. The search wraps around to the first inode bitmap block with free bits.
+ */
+int64_t dwarfs_inode_alloc(struct super_block *sb, struct inode *dir, umode_t mode) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_superblock *dfsb = dfsb_i->dfsb;
+    uint64_t bits = dwarfs_bitmap_bits(sb);
+    uint64_t bitmapblocks = DIV_ROUND_UP_ULL(dfsb->dwarfs_inodec, bits);
+    uint64_t goal, bitmapblock;
+    int64_t ino;
+
+    mutex_lock(&dfsb_i->dwarfs_inode_bitmap_lock);
+    goal = (dir && !S_ISDIR(mode)) ? dir->i_ino + 1 : dfsb_i->dwarfs_inode_cursor;
+    if(goal >= dfsb->dwarfs_inodec)
+        goal = 0;
+
+    ino = dwarfs_inode_alloc_from(sb, goal / bits, goal % bits);
+    for(bitmapblock = goal / bits + 1; ino == -ENOSPC && bitmapblock < bitmapblocks; bitmapblock++)
+        ino = dwarfs_inode_alloc_from(sb, bitmapblock, 0);
+    for(bitmapblock = dfsb_i->dwarfs_inode_first_free; ino == -ENOSPC && bitmapblock <= goal / bits; bitmapblock++)
+        ino = dwarfs_inode_alloc_from(sb, bitmapblock, 0);
+
+    if(ino >= 0 && S_ISDIR(mode))
+        dfsb_i->dwarfs_inode_cursor = roundup(ino + 1, dfsb_i->dwarfs_inodes_per_block);
     mutex_unlock(&dfsb_i->dwarfs_inode_bitmap_lock);
 
-    return ino + sb->s_blocksize * bitmapblock;
+    if(ino == -ENOSPC)
+        printk("Dwarfs: No free inodes! All %llu are in use\n", dfsb->dwarfs_inodec);
+    return ino;
 }
 
 int dwarfs_inode_dealloc(struct super_block *sb, int64_t ino) {
@@ -66,18 +102,21 @@ int dwarfs_inode_dealloc(struct super_block *sb, int64_t ino) {
         return PTR_ERR(inodebh);
     }
 
-    mutex_lock_interruptible(&dfsb_i->dwarfs_inode_bitmap_lock);
+    mutex_lock(&dfsb_i->dwarfs_inode_bitmap_lock);
 
     bmbh = read_inode_bitmap(sb, ino, &bitmapblock);
-    bitmap = (unsigned long *)bmbh->b_data;
-    if(IS_ERR(bmbh)) {
-        err = PTR_ERR(bmbh);
+    if(!bmbh) {
+        err = -EIO;
+        brelse(inodebh);
 	goto outerr;
     }
+    bitmap = (unsigned long *)bmbh->b_data;
 
-    dwarfs_flip_bitmap(bitmap, ino % sb->s_blocksize);
+    dwarfs_flip_bitmap(bitmap, ino % dwarfs_bitmap_bits(sb));
     dwarfs_write_buffer(&bmbh, sb);
-    dfsb_i->dwarfs_free_inodes_count++;
+    percpu_counter_inc(&dfsb_i->dwarfs_free_inodes_count);
+    if(ino / dwarfs_bitmap_bits(sb) < dfsb_i->dwarfs_inode_first_free)
+        dfsb_i->dwarfs_inode_first_free = ino / dwarfs_bitmap_bits(sb);
     mutex_unlock(&dfsb_i->dwarfs_inode_bitmap_lock);
 
     memset((char *)dinode, 0, sizeof(struct dwarfs_inode));
@@ -92,198 +131,754 @@ outerr:
 }
 
 /*
- * Function to get the first available datablock and mark it busy in the bitmap.
- * This function returns the blocknum with the offset to account for the data blocks'
- * position in the filesystem. The caller may use the returned value as-is.
+ * Number of data blocks tracked by the given data bitmap block.
+ * Every bitmap block is full, except possibly the last one.
  */
-int64_t dwarfs_data_alloc(struct super_block *sb, struct inode *inode) {
-    struct buffer_head *bmbh = NULL;
-    struct buffer_head *datbh = NULL;
+static inline uint64_t dwarfs_data_bitmap_bits(struct super_block *sb, uint64_t bitmapblock) {
+    uint64_t first = bitmapblock * dwarfs_bitmap_bits(sb);
+    return min_t(uint64_t, dwarfs_bitmap_bits(sb), DWARFS_SB(sb)->dfsb->dwarfs_blockc - first);
+}
+
+static inline struct dwarfs_alloc_group *dwarfs_bitmap_group(struct dwarfs_superblock_info *dfsb_i, uint64_t bitmapblock) {
+    return dfsb_i->dwarfs_groups + bitmapblock / dfsb_i->dwarfs_bitmaps_per_group;
+}
+
+/*
+ * Build the in-memory free space summary of the data bitmap, and split the
+ * data bitmap into allocation groups, one per CPU as long as there are enough bitmap blocks.
+ * Every data bitmap block is read once at mount, after which the allocator
+ * only reads bitmap blocks that are known to have free bits in them.
+ */
+int dwarfs_init_free_summary(struct super_block *sb) {
     struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
     struct dwarfs_superblock *dfsb = dfsb_i->dfsb;
+    struct dwarfs_alloc_group *group = NULL;
+    struct buffer_head *bmbh = NULL;
+    uint64_t bitmapblocks = DIV_ROUND_UP_ULL(dfsb->dwarfs_blockc, dwarfs_bitmap_bits(sb));
+    uint64_t freec = 0;
+    uint64_t bits, i;
+
+    dfsb_i->dwarfs_data_bitmap_blocks = bitmapblocks;
+    dfsb_i->dwarfs_groupc = min_t(uint64_t, num_possible_cpus(), bitmapblocks);
+    dfsb_i->dwarfs_bitmaps_per_group = DIV_ROUND_UP_ULL(bitmapblocks, dfsb_i->dwarfs_groupc);
+    dfsb_i->dwarfs_groupc = DIV_ROUND_UP_ULL(bitmapblocks, dfsb_i->dwarfs_bitmaps_per_group);
+
+    dfsb_i->dwarfs_bitmap_free = kvcalloc(bitmapblocks, sizeof(uint32_t), GFP_KERNEL);
+    dfsb_i->dwarfs_groups = kcalloc(dfsb_i->dwarfs_groupc, sizeof(struct dwarfs_alloc_group), GFP_KERNEL);
+    if(!dfsb_i->dwarfs_bitmap_free || !dfsb_i->dwarfs_groups) {
+        printk("Dwarfs: couldn't allocate the free space summary!\n");
+        dwarfs_destroy_free_summary(sb);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < dfsb_i->dwarfs_groupc; i++) {
+        group = dfsb_i->dwarfs_groups + i;
+        mutex_init(&group->lock);
+        group->first_bitmap = i * dfsb_i->dwarfs_bitmaps_per_group;
+        group->end_bitmap = min_t(uint64_t, group->first_bitmap + dfsb_i->dwarfs_bitmaps_per_group, bitmapblocks);
+        group->next_free = group->first_bitmap;
+    }
+
+    for(i = 0; i < bitmapblocks; i++) {
+        if(!(bmbh = sb_bread(sb, dfsb->dwarfs_data_bitmap_start + i))) {
+            printk("Dwarfs: unable to read data bitmap block %llu\n", i);
+            dwarfs_destroy_free_summary(sb);
+            return -EIO;
+        }
+        bits = dwarfs_data_bitmap_bits(sb, i);
+        dfsb_i->dwarfs_bitmap_free[i] = bits - bitmap_weight((unsigned long *)bmbh->b_data, bits);
+        dwarfs_bitmap_group(dfsb_i, i)->freec += dfsb_i->dwarfs_bitmap_free[i];
+        freec += dfsb_i->dwarfs_bitmap_free[i];
+        brelse(bmbh);
+    }
+
+    if(percpu_counter_init(&dfsb_i->dwarfs_free_blocks_count, freec, GFP_KERNEL) ||
+       percpu_counter_init(&dfsb_i->dwarfs_free_inodes_count, le64_to_cpu(dfsb->dwarfs_free_inodes_count), GFP_KERNEL)) {
+        dwarfs_destroy_free_summary(sb);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void dwarfs_destroy_free_summary(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+
+    percpu_counter_destroy(&dfsb_i->dwarfs_free_blocks_count);
+    percpu_counter_destroy(&dfsb_i->dwarfs_free_inodes_count);
+    kvfree(dfsb_i->dwarfs_bitmap_free);
+    kfree(dfsb_i->dwarfs_groups);
+    dfsb_i->dwarfs_bitmap_free = NULL;
+    dfsb_i->dwarfs_groups = NULL;
+    dfsb_i->dwarfs_data_bitmap_blocks = 0;
+    dfsb_i->dwarfs_groupc = 0;
+}
+
+/*
+ * Find a run of free bits between bits start and end of a bitmap block, preferring the first
+ * run that is at least want bits long and settling for the longest shorter run otherwise.
+ * Returns the length of the run, and its first bit in *runstart. 0 if there are no free bits.
+ */
+static unsigned long dwarfs_find_free_run(void *bitmap, unsigned long start, unsigned long end, unsigned long want, unsigned long *runstart) {
+    unsigned long pos = start, runend, bestlen = 0;
+
+    while((pos = find_next_zero_bit_le(bitmap, end, pos)) < end) {
+        runend = find_next_bit_le(bitmap, min(end, pos + want), pos);
+        if(runend - pos > bestlen) {
+            bestlen = runend - pos;
+            *runstart = pos;
+            if(bestlen >= want)
+                break;
+        }
+        pos = runend;
+    }
+    return bestlen;
+}
+
+/*
+ * Mark a run of blocks found in a data bitmap block busy, and account for it.
+ * The lock of the group owning the bitmap block must be held. Consumes bmbh.
+ */
+static void dwarfs_mark_run(struct super_block *sb, struct dwarfs_alloc_group *group, struct buffer_head *bmbh,
+                            uint64_t bitmapblock, unsigned long runstart, unsigned long runlen) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    unsigned long i;
+
+    for(i = 0; i < runlen; i++)
+        test_and_set_bit_le(runstart + i, bmbh->b_data);
+    dfsb_i->dwarfs_bitmap_free[bitmapblock] -= runlen;
+    group->freec -= runlen;
+    percpu_counter_sub(&dfsb_i->dwarfs_free_blocks_count, runlen);
+    dwarfs_write_buffer(&bmbh, sb);
+}
+
+/*
+ * Allocate a run of up to *count contiguous blocks from a single allocation group.
+ * The group lock must be held. The first block of the run, relative to the start
+ * of the data blocks, is returned in *relblock and the length of the run in *count.
+ * Returns -ENOSPC if the group has no free blocks left.
+ */
+static int dwarfs_group_alloc_blocks(struct super_block *sb, struct dwarfs_alloc_group *group, uint64_t *relblock, unsigned long *count) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct buffer_head *bmbh = NULL;
     unsigned long blocknum = 0;
-    int64_t bitmapblock = -1;
-    int mutex;
-
-    do {
-        bitmapblock++;
-	mutex = bitmapblock % 30;
-        blocknum = 0;
-	mutex_lock_interruptible(dfsb_i->dwarfs_bitmap_lock+mutex);
-        if(!(bmbh = sb_bread(sb, dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
+    unsigned long runlen = 0;
+    uint64_t bitmapblock, bits;
+
+    for(bitmapblock = group->next_free; bitmapblock < group->end_bitmap; bitmapblock++) {
+        if(!dfsb_i->dwarfs_bitmap_free[bitmapblock]) {
+            if(bitmapblock == group->next_free)
+                group->next_free++;
+            continue;
+        }
+        if(!(bmbh = sb_bread(sb, dfsb_i->dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
             printk("Dwarfs: unable to read data bitmap!\n");
-            mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
             return -EIO;
         }
-        blocknum = find_next_zero_bit_le((unsigned long *)bmbh->b_data, sb->s_blocksize, blocknum);
-        if(blocknum * bitmapblock > dfsb->dwarfs_blockc) {
-            printk("Dwarfs: Couldn't find any free data blocks!\n");
+        bits = dwarfs_data_bitmap_bits(sb, bitmapblock);
+        runlen = dwarfs_find_free_run(bmbh->b_data, 0, bits, *count, &blocknum);
+        if(runlen)
+            goto found;
+
+        /* The summary was out of sync with the bitmap, correct it and move on */
+        printk("Dwarfs: free space summary of bitmap block %llu was stale\n", bitmapblock);
+        group->freec -= dfsb_i->dwarfs_bitmap_free[bitmapblock];
+        dfsb_i->dwarfs_bitmap_free[bitmapblock] = 0;
+        brelse(bmbh);
+    }
+    group->freec = 0;
+    return -ENOSPC;
+
+found:
+    dwarfs_mark_run(sb, group, bmbh, bitmapblock, blocknum, runlen);
+    *relblock = blocknum + bitmapblock * dwarfs_bitmap_bits(sb);
+    *count = runlen;
+    return 0;
+}
+
+/*
+ * Reservation windows.
+ * Every inode writing file data owns a window of upcoming data blocks, and allocates
+ * from it before it goes to the allocation groups. Windows of different inodes never
+ * overlap, so files that are appended to at the same time don't get their blocks interleaved.
+ * Windows live in a per-mount tree sorted by their first block, and never cross a bitmap block.
+ */
+
+/* Find the first window that ends after block, or NULL. The tree lock must be held. */
+static struct dwarfs_rsv_window *dwarfs_rsv_search(struct dwarfs_superblock_info *dfsb_i, uint64_t block) {
+    struct rb_node *node = dfsb_i->dwarfs_rsv_tree.rb_node;
+    struct dwarfs_rsv_window *rsv, *found = NULL;
+
+    while(node) {
+        rsv = rb_entry(node, struct dwarfs_rsv_window, node);
+        if(rsv->end <= block)
+            node = node->rb_right;
+        else {
+            found = rsv;
+            node = node->rb_left;
+        }
+    }
+    return found;
+}
+
+static void dwarfs_rsv_insert(struct dwarfs_superblock_info *dfsb_i, struct dwarfs_rsv_window *rsv) {
+    struct rb_node **link = &dfsb_i->dwarfs_rsv_tree.rb_node;
+    struct rb_node *parent = NULL;
+
+    while(*link) {
+        parent = *link;
+        if(rsv->start < rb_entry(parent, struct dwarfs_rsv_window, node)->start)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    rb_link_node(&rsv->node, parent, link);
+    rb_insert_color(&rsv->node, &dfsb_i->dwarfs_rsv_tree);
+}
+
+static void dwarfs_rsv_remove(struct dwarfs_superblock_info *dfsb_i, struct dwarfs_rsv_window *rsv) {
+    spin_lock(&dfsb_i->dwarfs_rsv_lock);
+    if(!RB_EMPTY_NODE(&rsv->node)) {
+        rb_erase(&rsv->node, &dfsb_i->dwarfs_rsv_tree);
+        RB_CLEAR_NODE(&rsv->node);
+    }
+    rsv->start = rsv->end = 0;
+    spin_unlock(&dfsb_i->dwarfs_rsv_lock);
+}
+
+/*
+ * Drop the reservation window of an inode, when a writer closes the file or the inode is evicted.
+ */
+void dwarfs_discard_window(struct inode *inode) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+
+    mutex_lock(&dinode_i->inode_rsv_lock);
+    dwarfs_rsv_remove(DWARFS_SB(inode->i_sb), &dinode_i->inode_rsv);
+    mutex_unlock(&dinode_i->inode_rsv_lock);
+}
+
+/*
+ * Open a new window of rsv->goal_size blocks for the inode, at the first free block at or
+ * after goal that isn't in another inode's window. The inode's window lock must be held.
+ * With trylock set, returns -EBUSY instead of waiting when the group of the first bitmap
+ * block with free bits is locked.
+ */
+static int dwarfs_rsv_new_window(struct super_block *sb, struct dwarfs_rsv_window *rsv, uint64_t goal, bool trylock) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_alloc_group *group = NULL;
+    struct dwarfs_rsv_window *next = NULL;
+    struct buffer_head *bmbh = NULL;
+    uint64_t bitmapbits = dwarfs_bitmap_bits(sb);
+    uint64_t goalbitmap;
+    uint64_t bitmapblock, base, bits, i;
+    unsigned long pos;
+
+    if(goal >= dfsb_i->dfsb->dwarfs_blockc)
+        goal = 0;
+    goalbitmap = goal / bitmapbits;
+
+    for(i = 0; i < dfsb_i->dwarfs_data_bitmap_blocks; i++) {
+        bitmapblock = (goalbitmap + i) % dfsb_i->dwarfs_data_bitmap_blocks;
+        if(!READ_ONCE(dfsb_i->dwarfs_bitmap_free[bitmapblock]))
+            continue;
+
+        group = dwarfs_bitmap_group(dfsb_i, bitmapblock);
+        if(!trylock)
+            mutex_lock(&group->lock);
+        else if(!mutex_trylock(&group->lock))
+            return -EBUSY;
+        trylock = false;
+        if(!(bmbh = sb_bread(sb, dfsb_i->dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
+            mutex_unlock(&group->lock);
+            return -EIO;
+        }
+        base = bitmapblock * bitmapbits;
+        bits = dwarfs_data_bitmap_bits(sb, bitmapblock);
+        pos = i ? 0 : goal - base;
+        while((pos = find_next_zero_bit_le(bmbh->b_data, bits, pos)) < bits) {
+            spin_lock(&dfsb_i->dwarfs_rsv_lock);
+            next = dwarfs_rsv_search(dfsb_i, base + pos);
+            if(next && next->start <= base + pos) { // Owned by someone else, skip their window
+                pos = next->end - base;
+                spin_unlock(&dfsb_i->dwarfs_rsv_lock);
+                continue;
+            }
+            rsv->start = base + pos;
+            rsv->end = min(rsv->start + rsv->goal_size, base + bits);
+            if(next)
+                rsv->end = min(rsv->end, next->start);
+            dwarfs_rsv_insert(dfsb_i, rsv);
+            spin_unlock(&dfsb_i->dwarfs_rsv_lock);
             brelse(bmbh);
-            mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-	    return -ENOSPC;
+            mutex_unlock(&group->lock);
+            return 0;
         }
-	if(blocknum < sb->s_blocksize)
-	    break;
-	brelse(bmbh);
-	mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-    } while(blocknum >= sb->s_blocksize);
-    test_and_set_bit(blocknum, (unsigned long *)bmbh->b_data);
-    dfsb_i->dwarfs_free_blocks_count--;
-    dwarfs_write_buffer(&bmbh, sb);
-    mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
+        brelse(bmbh);
+        mutex_unlock(&group->lock);
+    }
+    return -ENOSPC;
+}
 
-    // zero-initalise the new block
-    blocknum = blocknum + (bitmapblock * sb->s_blocksize) + dwarfs_datastart(sb);
-    datbh = sb_bread(sb, blocknum);
-    if(!datbh) {
-        printk("Dwarfs: couldn't get BH for the new datablock: %lu\n", blocknum);
+/*
+ * Allocate a run of up to *count blocks from the inode's window. The window moves past
+ * the blocks it hands out. The inode's window lock must be held.
+ */
+static int dwarfs_rsv_window_alloc(struct super_block *sb, struct dwarfs_rsv_window *rsv, uint64_t *relblock, unsigned long *count) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_alloc_group *group = NULL;
+    struct buffer_head *bmbh = NULL;
+    uint64_t bitmapblock = rsv->start / dwarfs_bitmap_bits(sb);
+    uint64_t base = bitmapblock * dwarfs_bitmap_bits(sb);
+    unsigned long runstart = 0, runlen;
+
+    group = dwarfs_bitmap_group(dfsb_i, bitmapblock);
+    mutex_lock(&group->lock);
+    if(!(bmbh = sb_bread(sb, dfsb_i->dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
+        mutex_unlock(&group->lock);
         return -EIO;
     }
+    runlen = dwarfs_find_free_run(bmbh->b_data, rsv->start - base, rsv->end - base, *count, &runstart);
+    if(!runlen) {
+        brelse(bmbh);
+        mutex_unlock(&group->lock);
+        return -ENOSPC;
+    }
+    dwarfs_mark_run(sb, group, bmbh, bitmapblock, runstart, runlen);
+    mutex_unlock(&group->lock);
+
+    spin_lock(&dfsb_i->dwarfs_rsv_lock);
+    rsv->start = base + runstart + runlen;
+    spin_unlock(&dfsb_i->dwarfs_rsv_lock);
+
+    *relblock = base + runstart;
+    *count = runlen;
+    return 0;
+}
+
+/*
+ * Allocate a run of up to *count blocks for the inode through its reservation window.
+ * The first window is placed where the inode sits in the inode table, scaled to the data
+ * blocks, so files of the same directory keep their data near each other. Files of a
+ * directory share that group though, so when another writer holds its lock the window
+ * goes to the CPU's home group instead, and concurrent writers keep their own groups.
+ * Once a window is used up, the next one starts right after it and is twice as large,
+ * so files that are written quickly get large windows.
+ */
+static int dwarfs_rsv_alloc_blocks(struct super_block *sb, struct inode *inode, uint64_t *relblock, unsigned long *count) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    struct dwarfs_rsv_window *rsv = &dinode_i->inode_rsv;
+    uint64_t goal;
+    bool near = false;
+    int err = -ENOSPC;
+
+    mutex_lock(&dinode_i->inode_rsv_lock);
+    if(rsv->start < rsv->end) {
+        err = dwarfs_rsv_window_alloc(sb, rsv, relblock, count);
+        if(err != -ENOSPC)
+            goto out;
+    }
+
+    if(rsv->end) {
+        goal = rsv->end;
+        rsv->goal_size = min_t(uint64_t, rsv->goal_size * 2, DWARFS_RSV_MAX_WINDOW);
+    } else { // Inodes that are close in the inode table get their data close together too
+        goal = inode->i_ino * dfsb_i->dfsb->dwarfs_blockc / dfsb_i->dfsb->dwarfs_inodec;
+        near = true;
+    }
+    rsv->goal_size = max_t(uint64_t, rsv->goal_size, min_t(uint64_t, *count, DWARFS_RSV_MAX_WINDOW));
+    dwarfs_rsv_remove(dfsb_i, rsv);
+
+    err = dwarfs_rsv_new_window(sb, rsv, goal, near);
+    if(err == -EBUSY) {
+        goal = dfsb_i->dwarfs_groups[raw_smp_processor_id() % dfsb_i->dwarfs_groupc].next_free * dwarfs_bitmap_bits(sb);
+        err = dwarfs_rsv_new_window(sb, rsv, goal, false);
+    }
+    if(!err)
+        err = dwarfs_rsv_window_alloc(sb, rsv, relblock, count);
+out:
+    mutex_unlock(&dinode_i->inode_rsv_lock);
+    return err;
+}
+
+/*
+ * Function to get a run of up to *count contiguous datablocks and mark them busy in the bitmap.
+ * This function returns the first blocknum with the offset to account for the data blocks'
+ * position in the filesystem, and the number of blocks in the run in *count.
+ * The caller may use the returned value as-is.
+ *
+ * File data comes from the inode's reservation window when there is one.
+ * Otherwise every CPU allocates from its own home group, so concurrent writers don't contend
+ * on the same lock and bitmap blocks. Other groups are only used once the home group is full.
+ * Runs never cross a bitmap block, so they can be shorter than asked for.
+ *
+ * The blocks aren't zeroed or even read. Callers mapping them for file data set the buffers
+ * new, so the page cache zeroes whatever part of a block a write doesn't cover.
+ */
+int64_t dwarfs_data_alloc_blocks(struct super_block *sb, struct inode *inode, unsigned long *count) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_alloc_group *group = NULL;
+    unsigned int home = raw_smp_processor_id() % dfsb_i->dwarfs_groupc;
+    uint64_t relblock;
+    unsigned long i;
+    int err;
+
+    if(S_ISREG(inode->i_mode)) {
+        err = dwarfs_rsv_alloc_blocks(sb, inode, &relblock, count);
+        if(!err)
+            goto found;
+        if(err != -ENOSPC)
+            return err;
+    }
+
+    for(i = 0; i < dfsb_i->dwarfs_groupc; i++) {
+        group = dfsb_i->dwarfs_groups + (home + i) % dfsb_i->dwarfs_groupc;
+        if(!READ_ONCE(group->freec))
+            continue;
+        mutex_lock(&group->lock);
+        err = dwarfs_group_alloc_blocks(sb, group, &relblock, count);
+        mutex_unlock(&group->lock);
+        if(!err)
+            goto found;
+        if(err != -ENOSPC)
+            return err;
+    }
+    printk("Dwarfs: Couldn't find any free data blocks!\n");
+    return -ENOSPC;
+
+found:
+    inode->i_blocks += *count;
+    return (int64_t)(relblock + dwarfs_datastart(sb));
+}
+
+/*
+ * Function to get the first available datablock and mark it busy in the bitmap.
+ * This is meant for metadata (directory and list blocks), so the block is zeroed,
+ * without reading its old contents first.
+ */
+int64_t dwarfs_data_alloc(struct super_block *sb, struct inode *inode) {
+    struct buffer_head *datbh = NULL;
+    unsigned long count = 1;
+    int64_t blocknum;
+
+    blocknum = dwarfs_data_alloc_blocks(sb, inode, &count);
+    if(blocknum < 0)
+        return blocknum;
+
+    if(!(datbh = sb_getblk(sb, blocknum))) {
+        printk("Dwarfs: couldn't get BH for the new datablock: %lld\n", blocknum);
+        return -EIO;
+    }
+    lock_buffer(datbh);
     memset(datbh->b_data, 0, datbh->b_size);
+    set_buffer_uptodate(datbh);
+    unlock_buffer(datbh);
     dwarfs_write_buffer(&datbh, sb);
-    inode->i_blocks++;
-
-    return (int64_t)blocknum;
+    return blocknum;
 }
 
-int dwarfs_data_dealloc_indirect(struct super_block *sb, struct inode *inode) {
-    int i, j, blockc, blockpos, blockpostemp;
-    struct buffer_head *bmbh = NULL;
-    struct buffer_head *ptrbh = NULL;
-    struct buffer_head *databh = NULL;
-    __le64 *buf = NULL;
-    __le64 blocknum;
-    unsigned long *bitmap = NULL;
+/*
+ * Return a run of data blocks to the data bitmap and the free space summary.
+ * The run may span several bitmap blocks, each of which is updated under its group lock.
+ */
+int dwarfs_data_free_blocks(struct super_block *sb, uint64_t blocknum, uint64_t count) {
     struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
-    int mutex;
+    struct dwarfs_alloc_group *group = NULL;
+    struct buffer_head *bmbh = NULL;
+    uint64_t relblock, bitmapblock, bit, n, i, freed;
+    int err = 0;
 
-    // Figure out how many linked list levels we're deallocating.
-    blockc = dwarfs_divround(inode->i_blocks - DWARFS_INODE_INDIR, (sb->s_blocksize / sizeof(__le64)) - 1);
+    if(blocknum < dwarfs_datastart(sb) || blocknum + count > dwarfs_datastart(sb) + dfsb_i->dfsb->dwarfs_blockc) {
+        printk("Dwarfs: freeing blocks %llu-%llu outside of the data blocks\n", blocknum, blocknum + count - 1);
+        return -EFSCORRUPTED;
+    }
 
-    if(S_ISLNK(inode->i_mode))
+    while(count) {
+        relblock = blocknum - dwarfs_datastart(sb);
+        bitmapblock = relblock / dwarfs_bitmap_bits(sb);
+        bit = relblock % dwarfs_bitmap_bits(sb);
+        n = min(count, dwarfs_bitmap_bits(sb) - bit);
+        group = dwarfs_bitmap_group(dfsb_i, bitmapblock);
+
+        mutex_lock(&group->lock);
+        if(!(bmbh = sb_bread(sb, dfsb_i->dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
+            printk("Dwarfs: couldn't read the data bitmap of block %llu\n", blocknum);
+            mutex_unlock(&group->lock);
+            return -EIO;
+        }
+        for(i = 0, freed = 0; i < n; i++) {
+            if(test_and_clear_bit_le(bit + i, bmbh->b_data))
+                freed++;
+        }
+        if(freed < n) {
+            printk("Dwarfs: freeing blocks in %llu-%llu, which are already free\n", blocknum, blocknum + n - 1);
+            err = -EFSCORRUPTED;
+        }
+        dfsb_i->dwarfs_bitmap_free[bitmapblock] += freed;
+        group->freec += freed;
+        percpu_counter_add(&dfsb_i->dwarfs_free_blocks_count, freed);
+        if(bitmapblock < group->next_free)
+            group->next_free = bitmapblock;
+        dwarfs_write_buffer(&bmbh, sb);
+        mutex_unlock(&group->lock);
+
+        blocknum += n;
+        count -= n;
+    }
+    return err;
+}
+
+/*
+ * Blocks being freed are gathered into contiguous runs, so every run costs one pass over
+ * its bitmap block and, with the discard mount option, one discard request.
+ * The discard is issued before the bits are cleared, so the blocks can't be reused meanwhile.
+ */
+int dwarfs_free_batch_flush(struct super_block *sb, struct dwarfs_free_batch *batch) {
+    int err;
+
+    if(!batch->len)
         return 0;
+    if(dwarfs_test_opt(sb, DWARFS_MOUNT_DISCARD)) {
+        err = sb_issue_discard(sb, batch->start, batch->len, GFP_NOFS, 0);
+        if(err && err != -EOPNOTSUPP)
+            printk("Dwarfs: discard of blocks %llu-%llu failed: %d\n", batch->start, batch->start + batch->len - 1, err);
+    }
+    err = dwarfs_data_free_blocks(sb, batch->start, batch->len);
+    batch->len = 0;
+    return err;
+}
+
+int dwarfs_free_batch_add(struct super_block *sb, struct dwarfs_free_batch *batch, uint64_t blocknum) {
+    int err = 0;
+
+    if(batch->len && batch->start + batch->len == blocknum) {
+        batch->len++;
+        return 0;
+    }
+    err = dwarfs_free_batch_flush(sb, batch);
+    batch->start = blocknum;
+    batch->len = 1;
+    return err;
+}
+
+static inline bool dwarfs_valid_datablock(struct super_block *sb, uint64_t blocknum) {
+    return blocknum >= dwarfs_datastart(sb) && blocknum < DWARFS_SB(sb)->dfsb->dwarfs_blockc + dwarfs_datastart(sb);
+}
+
+/*
+ * Free the data blocks and the blocks of the indirect list of an inode.
+ * Only the list blocks are read, the data blocks themselves are never touched.
+ */
+static int dwarfs_data_dealloc_indirect(struct super_block *sb, __le64 blockpos, struct dwarfs_free_batch *batch) {
+    int j, level = 0;
+    int ptrs = (sb->s_blocksize / sizeof(__le64)) - 1;
+    struct buffer_head *ptrbh = NULL;
+    __le64 *buf = NULL;
+    __le64 blocknum, blockpostemp;
+    int err;
 
     /*
      * We possibly need to dealloc multiple levels of the linked list, so
      * for each level, dealloc data pointers, then dealloc the pointer to
      * this level of the linked list, before moving on to the next level and repeating.
+     * Files can have holes, so follow the list until it ends instead of working
+     * out its length from i_blocks.
      */
-    blockpos = DWARFS_INODE(inode)->inode_data[DWARFS_INODE_INDIR];
-    for(i = 0; i < blockc; i++) {
+    while(blockpos) {
+        if(!dwarfs_valid_datablock(sb, blockpos)) {
+            printk("Dwarfs: invalid list block %llu at depth %d\n", blockpos, level);
+            return -EFSCORRUPTED;
+        }
         ptrbh = sb_bread(sb, blockpos);
         if(!ptrbh || IS_ERR(ptrbh)) {
 	    printk("Dwarfs: couldn't get list pointer buffer\n");
             return -EIO;
 	}
         buf = (__le64 *)ptrbh->b_data;
-        for(j = 0; j < (sb->s_blocksize / sizeof(__le64)) - 1; j++) {
-	    if(DWARFS_INODE_INDIR + j + (i * ((sb->s_blocksize / sizeof(__le64)) - 1)) >= inode->i_blocks) {
-		    break;
-	    }
-            if(buf[j] == 0 || buf[j] > DWARFS_SB(sb)->dfsb->dwarfs_blockc + dwarfs_datastart(sb))
+        for(j = 0; j < ptrs; j++) {
+            blocknum = dwarfs_blockptr_blockno(buf[j]);
+            if(!dwarfs_valid_datablock(sb, blocknum))
                 continue;
-            blocknum = buf[j];
-            databh = sb_bread(sb, blocknum);
-            if(!databh || IS_ERR(databh)) {
-		printk("Couldn't get data buffer\n");
-                return -EIO;
-	    }
-
-            memset(databh->b_data, 0, databh->b_size);
-            dwarfs_write_buffer(&databh, sb);
-
-	    mutex = ((blocknum - dwarfs_datastart(sb)) / sb->s_blocksize) % 30;
-
-	    mutex_lock_interruptible(dfsb_i->dwarfs_bitmap_lock+mutex);
-            bmbh = read_data_bitmap(sb, blocknum, NULL);
-	    if(!bmbh || IS_ERR(bmbh)) {
-		    printk("Couldn't read bitmap buffer. At depth %d of %d\n", i, blockc);
-		    mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-		    return -EIO;
-	    }
-            bitmap = (unsigned long *)bmbh->b_data;
-            blocknum -= dwarfs_datastart(sb); // account for the position in the bitmap
-            dwarfs_flip_bitmap(bitmap, blocknum % sb->s_blocksize);
-            dfsb_i->dwarfs_free_blocks_count++;
-            dwarfs_write_buffer(&bmbh, sb);
-	    mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-            bmbh = NULL;
-            bitmap = NULL;
+            if((err = dwarfs_free_batch_add(sb, batch, blocknum))) {
+		    printk("Couldn't free data block. At depth %d\n", level);
+		    brelse(ptrbh);
+		    return err;
+            }
         }
-	mutex = ((blockpos - dwarfs_datastart(sb)) / sb->s_blocksize) % 30;
-        blockpostemp = buf[(sb->s_blocksize / sizeof(__le64)) - 1];
-        memset(ptrbh->b_data, 0, ptrbh->b_size); // level done, set all ptrs 0
-        dwarfs_write_buffer(&ptrbh, sb);
-
-	mutex_lock_interruptible(dfsb_i->dwarfs_bitmap_lock+mutex);
-        bmbh = read_data_bitmap(sb, blockpos, NULL);
-	if(!bmbh || IS_ERR(bmbh)) {
-		printk("Dwarfs: Failed to read bitmap buffer! Depth: %d of %d\n", i, blockc);
-		mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-		return -EIO;
+        blockpostemp = buf[ptrs];
+        bforget(ptrbh); // The list block is going away, don't write it back
+
+        if((err = dwarfs_free_batch_add(sb, batch, blockpos))) { // Dealloc the pointer to the list
+		printk("Dwarfs: Failed to free list block! Depth: %d\n", level);
+		return err;
 	}
-        bitmap = (unsigned long *)bmbh->b_data;
-        blockpos -= dwarfs_datastart(sb);
-        dwarfs_flip_bitmap(bitmap, blockpos % sb->s_blocksize); // Dealloc the pointer to the list
-	dfsb_i->dwarfs_free_blocks_count++;
-        dwarfs_write_buffer(&bmbh, sb);
-	mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
 	blockpos = blockpostemp;
-        bmbh = NULL;
-        bitmap = NULL;
+        level++;
+        cond_resched();
     }
     return 0;
 }
 
-int dwarfs_data_dealloc(struct super_block *sb, struct inode *inode) {
-    struct buffer_head *bmbh = NULL;
-    struct buffer_head *databh = NULL;
-    char *datablock = NULL;
-    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
-    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
-    int i;
-    unsigned long *bitmap = NULL;
+/*
+ * Free every block reachable from the block pointers of an inode, in contiguous batches.
+ * The inode flags tell whether the pointers hold an extent tree, or inline data.
+ */
+int dwarfs_data_dealloc_blocks(struct super_block *sb, __le64 *blocks, uint64_t flags) {
+    struct dwarfs_free_batch batch = { 0 };
+    int i, err = 0, flusherr;
 
-    if(S_ISLNK(inode->i_mode))
+    if(flags & FS_INLINE_DATA_FL) // The pointers hold file data
         return 0;
-    if(IS_ERR(dinode_i))
-        return PTR_ERR(dinode_i);
+    if(flags & FS_EXTENT_FL) {
+        err = dwarfs_ext_dealloc(sb, blocks, &batch);
+        // Blocks already in the batch are gone from the tree, free them even on error
+        flusherr = dwarfs_free_batch_flush(sb, &batch);
+        return err ? err : flusherr;
+    }
 
     /*
      * Direct blocks are simple, except that index 14 might point to a
      * linked list and must be handled separately
      */
-    for(i = 0; i < DWARFS_NUMBLOCKS; i++) {
-        int64_t blocknum = dinode_i->inode_data[i];
-	int mutex = ((blocknum - dwarfs_datastart(sb)) / sb->s_blocksize) % 30;
+    for(i = 0; i < DWARFS_NUMBLOCKS && !err; i++) {
+        uint64_t blocknum = dwarfs_blockptr_blockno(blocks[i]);
 
         if(blocknum == 0)
             continue;
-	if(i == DWARFS_NUMBLOCKS-1) {
-		dwarfs_data_dealloc_indirect(sb, inode);
-		dinode_i->inode_data[i] = 0;
-		break;
-	}
-	databh = sb_bread(sb, blocknum);
-        if(!databh) {
-            brelse(bmbh);
-	    printk("Couldn't get databh\n");
-            return -EIO;
-        }
-        datablock = (char *)databh->b_data;
-        memset(datablock, 0, DWARFS_BLOCK_SIZE);
-        dwarfs_write_buffer(&databh, sb);
-        dinode_i->inode_data[i] = 0;
-
-	mutex_lock_interruptible(dfsb_i->dwarfs_bitmap_lock+mutex);
-	bmbh = read_data_bitmap(sb, blocknum, NULL);
-	bitmap = (unsigned long *)bmbh->b_data;
-	dwarfs_flip_bitmap(bitmap, (blocknum-dwarfs_datastart(sb)) % sb->s_blocksize);
-	dfsb_i->dwarfs_free_blocks_count++;
-	dwarfs_write_buffer(&bmbh, sb);
-	mutex_unlock(dfsb_i->dwarfs_bitmap_lock+mutex);
-	bitmap = NULL;
+	if(i == DWARFS_NUMBLOCKS-1)
+		err = dwarfs_data_dealloc_indirect(sb, blocks[i], &batch);
+	else if(dwarfs_valid_datablock(sb, blocknum))
+		err = dwarfs_free_batch_add(sb, &batch, blocknum);
     }
+    flusherr = dwarfs_free_batch_flush(sb, &batch);
+    return err ? err : flusherr;
+}
+
+int dwarfs_data_dealloc(struct super_block *sb, struct inode *inode) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    int err;
+
+    if(S_ISLNK(inode->i_mode))
+        return 0;
+    if(IS_ERR(dinode_i))
+        return PTR_ERR(dinode_i);
+
+    err = dwarfs_data_dealloc_blocks(sb, dinode_i->inode_data, dinode_i->inode_flags);
+    if(dwarfs_has_extents(inode))
+        dwarfs_ext_init(inode);
+    else
+        memset(dinode_i->inode_data, 0, sizeof(dinode_i->inode_data));
+    dwarfs_map_cache_invalidate(inode, 0, ~(sector_t)0, true);
     inode->i_blocks = 0;
+    return err;
+}
+
+/*
+ * Discard the free data blocks in the byte range of the device given by range, in runs
+ * of at least range->minlen bytes. Every bitmap block is trimmed under its group lock,
+ * so its free blocks can't be allocated while their discard is in flight.
+ * On return range->len holds the number of bytes discarded.
+ */
+int dwarfs_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_alloc_group *group = NULL;
+    struct buffer_head *bmbh = NULL;
+    unsigned int blkbits = sb->s_blocksize_bits;
+    uint64_t datastart = dwarfs_datastart(sb);
+    uint64_t start = range->start >> blkbits;
+    uint64_t end = start + (range->len >> blkbits);
+    uint64_t minlen = max_t(uint64_t, DIV_ROUND_UP_ULL(range->minlen, sb->s_blocksize), 1);
+    uint64_t bits = dwarfs_bitmap_bits(sb);
+    uint64_t trimmed = 0;
+    uint64_t bitmapblock;
+    unsigned long first, last, pos, runend;
+    int err = 0;
+
+    if(range->len < sb->s_blocksize)
+        return -EINVAL;
+    if(end < start) // Overflowed, trim up to the end of the device
+        end = U64_MAX;
+    start = start > datastart ? start - datastart : 0;
+    end = min(end, datastart + dfsb_i->dfsb->dwarfs_blockc);
+    end = end > datastart ? end - datastart : 0;
+
+    for(bitmapblock = start / bits; bitmapblock * bits < end && !err; bitmapblock++) {
+        if(READ_ONCE(dfsb_i->dwarfs_bitmap_free[bitmapblock]) < minlen)
+            continue;
+        group = dwarfs_bitmap_group(dfsb_i, bitmapblock);
+        first = bitmapblock * bits < start ? start % bits : 0;
+        last = min(dwarfs_data_bitmap_bits(sb, bitmapblock), end - bitmapblock * bits);
+
+        mutex_lock(&group->lock);
+        if(!(bmbh = sb_bread(sb, dfsb_i->dfsb->dwarfs_data_bitmap_start + bitmapblock))) {
+            printk("Dwarfs: unable to read data bitmap block %llu\n", bitmapblock);
+            mutex_unlock(&group->lock);
+            err = -EIO;
+            break;
+        }
+        pos = first;
+        while((pos = find_next_zero_bit_le(bmbh->b_data, last, pos)) < last) {
+            runend = find_next_bit_le(bmbh->b_data, last, pos);
+            if(runend - pos >= minlen) {
+                err = sb_issue_discard(sb, datastart + bitmapblock * bits + pos, runend - pos, GFP_NOFS, 0);
+                if(err)
+                    break;
+                trimmed += runend - pos;
+            }
+            pos = runend;
+        }
+        brelse(bmbh);
+        mutex_unlock(&group->lock);
+
+        if(!err && fatal_signal_pending(current))
+            err = -ERESTARTSYS;
+        cond_resched();
+    }
+    range->len = trimmed << blkbits;
+    return err;
+}
+
+/*
+ * Number of blocks a delayed allocation of logical block iblock may need once it's
+ * written back. The first block of every level of the indirect list also needs the list block.
+ * Extent trees get a block per leaf worth of blocks, enough unless the file is badly fragmented.
+ */
+static inline unsigned long dwarfs_delalloc_cost(struct inode *inode, sector_t iblock) {
+    struct super_block *sb = inode->i_sb;
+    unsigned long ptrs = (sb->s_blocksize / sizeof(__le64)) - 1;
+    unsigned long extents = (sb->s_blocksize - sizeof(struct dwarfs_extent_header)) / sizeof(struct dwarfs_extent);
+
+    if(dwarfs_has_extents(inode))
+        return iblock % extents == 0 ? 2 : 1;
+    if(iblock >= DWARFS_INODE_INDIR && (iblock - DWARFS_INODE_INDIR) % ptrs == 0)
+        return 2;
+    return 1;
+}
+
+/*
+ * Reserve space for a delayed allocation of logical block iblock of the inode.
+ * Reserved blocks stay free in the bitmap until writeback, but can't be reserved again.
+ */
+int dwarfs_reserve_block(struct inode *inode, sector_t iblock) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(inode->i_sb);
+    unsigned long cost = dwarfs_delalloc_cost(inode, iblock);
+    s64 free = percpu_counter_read_positive(&dfsb_i->dwarfs_free_blocks_count);
+    s64 reserved = atomic64_add_return(cost, &dfsb_i->dwarfs_delalloc_blocks);
+    s64 margin = 2 * (s64)num_online_cpus() * percpu_counter_batch;
+
+    // The cheap estimate is off by up to the per-CPU deltas, so take the exact sum when it's close
+    if(free - reserved < margin)
+        free = percpu_counter_sum_positive(&dfsb_i->dwarfs_free_blocks_count);
+    if(reserved > free) {
+        atomic64_sub(cost, &dfsb_i->dwarfs_delalloc_blocks);
+        return -ENOSPC;
+    }
     return 0;
 }
+
+/*
+ * Hand back the space reserved for logical block iblock of the inode, once the block
+ * got allocated or the delayed write was dropped.
+ */
+void dwarfs_release_block(struct inode *inode, sector_t iblock) {
+    atomic64_sub(dwarfs_delalloc_cost(inode, iblock), &DWARFS_SB(inode->i_sb)->dwarfs_delalloc_blocks);
+}
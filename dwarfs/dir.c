@@ -8,6 +8,269 @@
 #include <linux/pagemap.h>
 #include <linux/iversion.h>
 
+/*
+ * Check that the entries of a variable length directory block add up to the block.
+ */
+static int dwarfs_dir_check_block(struct inode *dir, struct buffer_head *bh, sector_t lblk) {
+  unsigned int offset = 0;
+  struct dwarfs_directory_entry *direntry = NULL;
+  uint64_t len;
+
+  while(offset < dir->i_sb->s_blocksize) {
+    direntry = (struct dwarfs_directory_entry *)(bh->b_data + offset);
+    len = le64_to_cpu(direntry->entrylen);
+    if(len < dwarfs_dir_rec_len(dir, 0) || len % sizeof(__le64) || len > dir->i_sb->s_blocksize - offset ||
+       (direntry->inode && (!direntry->namelen || direntry->namelen > DWARFS_MAX_FILENAME_LEN || dwarfs_dir_rec_len(dir, direntry->namelen) > len))) {
+      printk("Dwarfs: bad entry at offset %u of block %llu of directory %lu\n", offset, (unsigned long long)lblk, dir->i_ino);
+      return -EFSCORRUPTED;
+    }
+    offset += len;
+  }
+  return 0;
+}
+
+/*
+ * Disk block backing block lblk of directory dir, allocated if create is set, or 0 if
+ * there is none. Directories with FS_EXTENT_FL set map their blocks like file data and
+ * can grow as far as that mapping goes. Older ones only have the direct pointers.
+ */
+static int dwarfs_dir_map(struct inode *dir, sector_t lblk, int create, sector_t *blockno) {
+  struct buffer_head map_bh;
+  int64_t newblock;
+  int err;
+
+  *blockno = 0;
+  if(!dwarfs_has_extents(dir)) {
+    if(lblk >= DWARFS_NUMBLOCKS)
+      return 0;
+    if(!DWARFS_INODE(dir)->inode_data[lblk] && create) {
+      if((newblock = dwarfs_data_alloc(dir->i_sb, dir)) < 0)
+        return newblock;
+      DWARFS_INODE(dir)->inode_data[lblk] = newblock;
+      mark_inode_dirty(dir);
+    }
+    *blockno = DWARFS_INODE(dir)->inode_data[lblk];
+    return 0;
+  }
+  map_bh.b_state = 0;
+  map_bh.b_size = dir->i_sb->s_blocksize;
+  if((err = dwarfs_get_iblock(dir, lblk, &map_bh, create)))
+    return err;
+  if(buffer_mapped(&map_bh))
+    *blockno = map_bh.b_blocknr;
+  return 0;
+}
+
+/*
+ * Read block lblk of directory dir, counted from the start of the directory.
+ */
+struct buffer_head *dwarfs_dir_bread(struct inode *dir, sector_t lblk) {
+  struct buffer_head *bh = NULL;
+  sector_t blockno;
+  int err;
+
+  if(lblk >= dwarfs_dir_blocks(dir)) {
+    printk("Dwarfs: directory %lu has no block %llu\n", dir->i_ino, (unsigned long long)lblk);
+    return ERR_PTR(-EFSCORRUPTED);
+  }
+  if((err = dwarfs_dir_map(dir, lblk, 0, &blockno)))
+    return ERR_PTR(err);
+  if(!blockno) {
+    printk("Dwarfs: block %llu of directory %lu is a hole\n", (unsigned long long)lblk, dir->i_ino);
+    return ERR_PTR(-EFSCORRUPTED);
+  }
+  if(!(bh = sb_bread(dir->i_sb, blockno))) {
+    printk("Dwarfs: couldn't read block %llu of directory %lu\n", (unsigned long long)lblk, dir->i_ino);
+    return ERR_PTR(-EIO);
+  }
+  if(dwarfs_dir_varlen(dir) && (err = dwarfs_dir_check_block(dir, bh, lblk))) {
+    brelse(bh);
+    return ERR_PTR(err);
+  }
+  return bh;
+}
+
+/*
+ * Add an empty block at the end of directory dir and read it. *lblk is set to its number.
+ * The last direct pointer of a directory without extents heads the indirect list when
+ * its blocks are freed, so it is never used for a new block.
+ */
+struct buffer_head *dwarfs_dir_append_block(struct inode *dir, sector_t *lblk) {
+  struct buffer_head *bh = NULL;
+  sector_t blockno;
+  int err;
+
+  *lblk = dwarfs_dir_blocks(dir);
+  if(!dwarfs_has_extents(dir) && *lblk >= DWARFS_INODE_INDIR) {
+    printk("Dwarfs: directory %lu is full!\n", dir->i_ino);
+    return ERR_PTR(-ENOSPC);
+  }
+  if((err = dwarfs_dir_map(dir, *lblk, 1, &blockno)))
+    return ERR_PTR(err);
+  if(!(bh = sb_getblk(dir->i_sb, blockno)))
+    return ERR_PTR(-ENOMEM);
+  lock_buffer(bh);
+  dwarfs_dir_pack(dir, bh->b_data, NULL, 0);
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  i_size_write(dir, (loff_t)(*lblk + 1) << dir->i_blkbits);
+  mark_inode_dirty(dir);
+  return bh;
+}
+
+/*
+ * Entry after direntry in block, which is block lblk of dir, or NULL at the end of it.
+ * In a fixed size directory that is indexed, the index root follows DOT and DOTDOT in
+ * block 0. In a variable length one DOTDOT covers it.
+ */
+struct dwarfs_directory_entry *dwarfs_dir_next(struct inode *dir, void *block, sector_t lblk, struct dwarfs_directory_entry *direntry) {
+  unsigned int slots = dir->i_sb->s_blocksize / sizeof(struct dwarfs_directory_entry);
+
+  if(dwarfs_dir_varlen(dir)) {
+    direntry = (struct dwarfs_directory_entry *)((char *)direntry + le64_to_cpu(direntry->entrylen));
+    return (char *)direntry < (char *)block + dir->i_sb->s_blocksize ? direntry : NULL;
+  }
+  if(!lblk && dwarfs_dir_indexed(dir))
+    slots = 2;
+  return ++direntry < (struct dwarfs_directory_entry *)block + slots ? direntry : NULL;
+}
+
+/*
+ * Rewrite block with count entries, packed from the start. In a variable length directory
+ * the last one takes the rest of the block, or an unused entry does if there are none.
+ * The entries must not point into block.
+ */
+void dwarfs_dir_pack(struct inode *dir, void *block, struct dwarfs_directory_entry **entries, int count) {
+  struct dwarfs_directory_entry *direntry = block;
+  unsigned int len;
+  int i;
+
+  memset(block, 0, dir->i_sb->s_blocksize);
+  for(i = 0; i < count; i++) {
+    len = dwarfs_dir_rec_len(dir, entries[i]->namelen);
+    memcpy(direntry, entries[i], min_t(unsigned int, len, sizeof(struct dwarfs_directory_entry)));
+    direntry->entrylen = cpu_to_le64(len);
+    if(i < count - 1)
+      direntry = (struct dwarfs_directory_entry *)((char *)direntry + len);
+  }
+  if(dwarfs_dir_varlen(dir))
+    direntry->entrylen = cpu_to_le64((char *)block + dir->i_sb->s_blocksize - (char *)direntry);
+}
+
+/*
+ * Find name in the directory block bh, which is block lblk of dir.
+ */
+struct dwarfs_directory_entry *dwarfs_dir_find_in_block(struct inode *dir, struct buffer_head *bh, sector_t lblk, const char *name, int namelen) {
+  struct dwarfs_directory_entry *direntry = (struct dwarfs_directory_entry *)bh->b_data;
+
+  for( ; direntry; direntry = dwarfs_dir_next(dir, bh->b_data, lblk, direntry)) {
+    if(direntry->inode && direntry->namelen == namelen && !memcmp(direntry->filename, name, namelen))
+      return direntry;
+  }
+  return NULL;
+}
+
+/*
+ * Entry of the directory block bh, which is block lblk of dir, that a name of namelen fits
+ * in: an unused one, or in a variable length directory one with enough free space after
+ * its name. NULL if the block is full.
+ */
+static struct dwarfs_directory_entry *dwarfs_dir_room(struct inode *dir, struct buffer_head *bh, sector_t lblk, int namelen) {
+  struct dwarfs_directory_entry *direntry = (struct dwarfs_directory_entry *)bh->b_data;
+  unsigned int need = dwarfs_dir_rec_len(dir, namelen);
+  unsigned int used;
+
+  for( ; direntry; direntry = dwarfs_dir_next(dir, bh->b_data, lblk, direntry)) {
+    used = direntry->inode ? dwarfs_dir_rec_len(dir, direntry->namelen) : 0;
+    if(!dwarfs_dir_varlen(dir)) {
+      if(!used)
+        return direntry;
+      continue;
+    }
+    if(le64_to_cpu(direntry->entrylen) - used >= need)
+      return direntry;
+  }
+  return NULL;
+}
+
+bool dwarfs_dir_has_room(struct inode *dir, struct buffer_head *bh, sector_t lblk, int namelen) {
+  return dwarfs_dir_room(dir, bh, lblk, namelen) != NULL;
+}
+
+/*
+ * Find room for a name of namelen in the directory block bh, which is block lblk of dir.
+ * An entry with free space after its name gives up that space to a new entry. The entry
+ * returned is unused, with entrylen set up.
+ */
+struct dwarfs_directory_entry *dwarfs_dir_add_slot(struct inode *dir, struct buffer_head *bh, sector_t lblk, int namelen) {
+  struct dwarfs_directory_entry *direntry = dwarfs_dir_room(dir, bh, lblk, namelen);
+  struct dwarfs_directory_entry *newentry = NULL;
+  unsigned int used;
+
+  if(!direntry || !direntry->inode)
+    return direntry;
+  used = dwarfs_dir_rec_len(dir, direntry->namelen);
+  newentry = (struct dwarfs_directory_entry *)((char *)direntry + used);
+  newentry->entrylen = cpu_to_le64(le64_to_cpu(direntry->entrylen) - used);
+  newentry->inode = 0;
+  direntry->entrylen = cpu_to_le64(used);
+  return newentry;
+}
+
+/*
+ * Remove direntry from the directory block bh. In a variable length directory the entry
+ * before it takes over its space, so free space doesn't fragment.
+ * The free slot hint of dir goes back to the start, see dwarfs_link_node.
+ */
+void dwarfs_dir_delete_entry(struct inode *dir, struct buffer_head *bh, struct dwarfs_directory_entry *direntry) {
+  struct dwarfs_directory_entry *prev = (struct dwarfs_directory_entry *)bh->b_data;
+  struct dwarfs_directory_entry *next = NULL;
+
+  if(DWARFS_INODE(dir)->inode_dir_start_lookup) {
+    DWARFS_INODE(dir)->inode_dir_start_lookup = 0;
+    mark_inode_dirty(dir);
+  }
+
+  if(!dwarfs_dir_varlen(dir)) {
+    direntry->entrylen = 0;
+    memset(direntry->filename, 0, DWARFS_MAX_FILENAME_LEN);
+    direntry->namelen = 0;
+    direntry->inode = 0;
+    return;
+  }
+  if(prev != direntry) {
+    while((next = (struct dwarfs_directory_entry *)((char *)prev + le64_to_cpu(prev->entrylen))) != direntry)
+      prev = next;
+    prev->entrylen = cpu_to_le64(le64_to_cpu(prev->entrylen) + le64_to_cpu(direntry->entrylen));
+    return;
+  }
+  direntry->inode = 0;
+  direntry->namelen = 0;
+}
+
+/*
+ * Find the entry for name in dir. Indexed directories only look at the leaf the name
+ * hashes to, others are scanned block by block. DOT and DOTDOT are always in block 0,
+ * which isn't a leaf, so they are found by the scan.
+ * Returns NULL if there is no such entry, otherwise *bh holds its block and must be released.
+ */
+struct dwarfs_directory_entry *dwarfs_find_entry(struct inode *dir, const char *name, int namelen, struct buffer_head **bh) {
+  struct dwarfs_directory_entry *direntry = NULL;
+  sector_t lblk;
+
+  if(dwarfs_dir_indexed(dir) && !(name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.'))))
+    return dwarfs_dx_find(dir, name, namelen, bh);
+  for(lblk = 0; lblk < dwarfs_dir_blocks(dir); lblk++) {
+    *bh = dwarfs_dir_bread(dir, lblk);
+    if(IS_ERR(*bh))
+      return ERR_CAST(*bh);
+    if((direntry = dwarfs_dir_find_in_block(dir, *bh, lblk, name, namelen)))
+      return direntry;
+    brelse(*bh);
+  }
+  return NULL;
+}
+
 /*
  * Make an empty dir after the inode has been instantiated in mkdir, and generate DOT & DOTDOT.
  * This must be done on a directory that has NO data, otherwise the 1st block is overwritten
@@ -17,36 +280,28 @@ int dwarfs_make_empty_dir(struct inode *inode, struct inode *dir) {
   struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
   struct buffer_head *bh = NULL;
   char *blockaddr = NULL;
-  int64_t first_blocknum = dwarfs_data_alloc(dir->i_sb, inode);
-
-  if(first_blocknum < 0) {
-    printk("Dwarfs: blocknum is error code: %lld\n", first_blocknum);
-    return first_blocknum;
-  }
-
-  dinode_i->inode_data[0] = first_blocknum;
-  if(!(bh =  sb_bread(dir->i_sb, dinode_i->inode_data[0]))) {
-    printk("Dwarfs: Failed to grab buffer head!\n");
-    return -ENOMEM;
+  sector_t lblk;
+
+  // New directories map their blocks through an extent tree and get variable length entries
+  dinode_i->inode_flags |= FS_EXTENT_FL | DWARFS_DIRENT2_FL;
+  dwarfs_ext_init(inode);
+  inode->i_size = 0;
+  bh = dwarfs_dir_append_block(inode, &lblk);
+  if(IS_ERR(bh)) {
+    printk("Dwarfs: couldn't add the first block of directory %lu\n", inode->i_ino);
+    return PTR_ERR(bh);
   }
 
+  // DOTDOT takes the rest of the block
   blockaddr = bh->b_data;
-  memset(blockaddr, 0, DWARFS_BLOCK_SIZE);
   direntry = (struct dwarfs_directory_entry *)blockaddr;
-  direntry->namelen = 1;
-  direntry->entrylen = sizeof(struct dwarfs_directory_entry);
-  direntry->inode = cpu_to_le64(inode->i_ino);
-  strncpy(direntry->filename, ".\0\0", 4);
-  direntry->filetype = 0;
-
-  direntry++;
-  direntry->namelen = 2;
-  direntry->entrylen = sizeof(struct dwarfs_directory_entry);
-  direntry->inode = cpu_to_le64(dir->i_ino);
-  strncpy(direntry->filename, "..\0", 4);
-  direntry->filetype = 0;
-
-  inode->i_size = dir->i_sb->s_blocksize;
+  dwarfs_set_direntry(inode, direntry, ".", 1, inode->i_ino, S_IFDIR);
+  direntry->entrylen = cpu_to_le64(dwarfs_dir_rec_len(inode, 1));
+
+  direntry = dwarfs_dir_next(inode, blockaddr, 0, direntry);
+  dwarfs_set_direntry(inode, direntry, "..", 2, dir->i_ino, S_IFDIR);
+  direntry->entrylen = cpu_to_le64(dir->i_sb->s_blocksize - dwarfs_dir_rec_len(inode, 1));
+
   dwarfs_write_buffer(&bh, dir->i_sb);
   return 0;
 }
@@ -78,27 +333,11 @@ static struct dentry *dwarfs_lookup(struct inode *dir, struct dentry *dentry, un
  * Only used to decide if it needs to be generated on mount or not
  */
 int dwarfs_rootdata_exists(struct super_block *sb, struct inode *inode) {
-  struct dwarfs_inode_info *dinode_i = NULL;
-  struct buffer_head *bh = NULL;
-  struct dwarfs_directory_entry *dirptr = NULL;
-
-  dinode_i = DWARFS_INODE(inode);
-  if(!dinode_i->inode_data[0]) {
-    printk("Dwarfs root_inode_data[0] doesnt exist!\n");
+  // The pointers of a directory with extents hold the tree root, not block numbers
+  if(!dwarfs_dir_blocks(inode) && (dwarfs_has_extents(inode) || !DWARFS_INODE(inode)->inode_data[0])) {
+    printk("Dwarfs: root directory has no blocks\n");
     return 0;
   }
-
-  if(!(bh = sb_bread(sb, dinode_i->inode_data[0]))) {
-    printk("Dwarfs rootdatablock not found!\n");
-    return -EIO;
-  }
-  dirptr = (struct dwarfs_directory_entry *)bh->b_data;
-  if(!dirptr) {
-    printk("rootdatablock is NULL\n");
-    brelse(bh);
-    return 0;
-  }
-  brelse(bh);
   return 1;
 }
 
@@ -130,32 +369,13 @@ static int dwarfs_link(struct dentry *src, struct inode *dir, struct dentry *des
  * On success, bh will contain the data block where the directory entry was found.
  */
 static struct dwarfs_directory_entry *dwarfs_get_direntry(const char *name, struct inode *dir, struct buffer_head **bh) {
-  struct dwarfs_directory_entry *currentry = NULL;
-  struct dwarfs_inode_info *dir_dinode_i = DWARFS_INODE(dir);
-  struct super_block *sb = dir->i_sb;
-  int i;
+  struct dwarfs_directory_entry *currentry = dwarfs_find_entry(dir, name, strlen(name), bh);
 
-  for(i = 0; i < dir->i_blocks; i++) {
-    if(!dir_dinode_i->inode_data[i])
-      continue;
-    *bh = sb_bread(sb, dir_dinode_i->inode_data[i]);
-    currentry = (struct dwarfs_directory_entry *)(*bh)->b_data;
-    for( ; (char *)currentry < (*bh)->b_data + sb->s_blocksize; currentry++) {
-      if(strncmp(currentry->filename, name, DWARFS_MAX_FILENAME_LEN) == 0) {
-        return currentry;
-      }
-    }
-    brelse(*bh);
+  if(!currentry) {
+    printk("Dwarfs: couldn't find directory entry %s\n", name);
+    return ERR_PTR(-ENOENT);
   }
-  printk("Dwarfs: couldn't find directory entry %s\n", name);
-  return ERR_PTR(-ENOENT);
-}
-
-static inline void dwarfs_clear_direntry(struct dwarfs_directory_entry *direntry) {
-  direntry->entrylen = 0;
-  memset(direntry->filename, 0, DWARFS_MAX_FILENAME_LEN);
-  direntry->namelen = 0;
-  direntry->inode = 0;
+  return currentry;
 }
 
 /*
@@ -171,14 +391,10 @@ static int dwarfs_unlink(struct inode *dir, struct dentry *l_dentry) {
     printk("Dwarfs: l_direntry is an error code!\n");
     return PTR_ERR(l_direntry);
   }
-  dwarfs_clear_direntry(l_direntry);
+  dwarfs_dir_delete_entry(dir, bh, l_direntry);
   dwarfs_write_buffer(&bh, dir->i_sb);
   l_inode->i_ctime = dir->i_ctime;
-  if(l_inode->i_nlink == 1 || (S_ISDIR(l_inode->i_mode) && l_inode->i_nlink == 2)) {
-    inode_dec_link_count(l_inode);
-    dwarfs_inode_dealloc(l_inode->i_sb, l_inode->i_ino);
-  }
-  else inode_dec_link_count(l_inode);
+  inode_dec_link_count(l_inode); // The inode itself is freed once it's evicted, see orphan.c
   return 0;
 }
 
@@ -230,8 +446,7 @@ cleanup:
 }
 
 static int dwarfs_check_dir_empty(struct inode *inode) {
-  struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
-  int i;
+  sector_t i;
   struct buffer_head *bh = NULL;
   
   /*
@@ -240,14 +455,12 @@ static int dwarfs_check_dir_empty(struct inode *inode) {
    * There is one base-case, that the datablock pointed to is 0.
    * Otherwise, we need to read through it and check the directory entry structures.
    */
-  for(i = 0; i < inode->i_blocks; i++) {
+  for(i = 0; i < dwarfs_dir_blocks(inode); i++) {
     struct dwarfs_directory_entry *direntry = NULL;
-    if(dinode_i->inode_data[i] == 0)
-      continue;
-    bh = sb_bread(inode->i_sb, dinode_i->inode_data[i]);
-    if(!bh || IS_ERR(bh)) {
+    bh = dwarfs_dir_bread(inode, i);
+    if(IS_ERR(bh)) {
       printk("Couldn't get directory buffer\n");
-      return -EIO;
+      return PTR_ERR(bh);
     }
     
     /*
@@ -256,11 +469,11 @@ static int dwarfs_check_dir_empty(struct inode *inode) {
      * store data of their own, and simply discarding them won't cause issues.
      */
     direntry = (struct dwarfs_directory_entry *)bh->b_data;
-    for( ; (char*)direntry < bh->b_data + DWARFS_BLOCK_SIZE; direntry++) {
+    for( ; direntry; direntry = dwarfs_dir_next(inode, bh->b_data, i, direntry)) {
       if(direntry->inode != 0 && direntry->namelen > 0) {
-        if(strncmp(direntry->filename, ".", DWARFS_MAX_FILENAME_LEN) != 0 && \
-            strncmp(direntry->filename, "..", DWARFS_MAX_FILENAME_LEN) != 0) {
-          printk("Dwarfs: found non-empty entry: %s, %llu\n", direntry->filename, direntry->inode);
+        if(!(direntry->namelen == 1 && direntry->filename[0] == '.') && \
+            !(direntry->namelen == 2 && !memcmp(direntry->filename, "..", 2))) {
+          printk("Dwarfs: found non-empty entry: %.*s, %llu\n", direntry->namelen, direntry->filename, direntry->inode);
           brelse(bh);
           return -ENOTEMPTY;
         }
@@ -336,14 +549,28 @@ static int dwarfs_rename(struct inode *dir, struct dentry *dentry, struct inode
   if((err = dquot_initialize(inode)))
     return err;
   
+  // Find DOTDOT before anything changes. Linking never touches the blocks of the moved directory
+  if(S_ISDIR(inode->i_mode)) {
+    dotdotdirent = dwarfs_get_direntry("..", inode, &dotdotbh);
+    if(IS_ERR(dotdotdirent))
+      return PTR_ERR(dotdotdirent);
+  }
+
+  // Link the new name first, adding it may move the entries of either directory around
+  if((err = dwarfs_link_node(newdentry, inode))) {
+    brelse(dotdotbh);
+    return err;
+  }
   dirent = dwarfs_get_direntry(dentry->d_name.name, dir, &direntbh);
-  if(IS_ERR(dirent))
-    return PTR_ERR(dirent);
+  if(IS_ERR(dirent)) {
+    err = PTR_ERR(dirent);
+    goto unlink_new;
+  }
+  dwarfs_dir_delete_entry(dir, direntbh, dirent);
+  dwarfs_write_buffer(&direntbh, dir->i_sb);
 
-  dwarfs_link_node(newdentry, inode);
-  if(S_ISDIR(inode->i_mode)) { // need to update DOTDOT
-    dotdotdirent = dwarfs_get_direntry("..", inode, &dotdotbh);
-    dotdotdirent->inode = newdir->i_ino;
+  if(dotdotdirent) {
+    dotdotdirent->inode = cpu_to_le64(newdir->i_ino);
     dwarfs_write_buffer(&dotdotbh, dir->i_sb);
     inode_dec_link_count(dir);
     inode_inc_link_count(newdir);
@@ -351,9 +578,16 @@ static int dwarfs_rename(struct inode *dir, struct dentry *dentry, struct inode
 
   inode->i_ctime = current_time(inode);
   mark_inode_dirty(inode);
-  dwarfs_clear_direntry(dirent);
-  dwarfs_write_buffer(&direntbh, dir->i_sb);
   return 0;
+
+unlink_new: // Leave the old name as the only one
+  brelse(dotdotbh);
+  dirent = dwarfs_get_direntry(newdentry->d_name.name, newdir, &direntbh);
+  if(!IS_ERR(dirent)) {
+    dwarfs_dir_delete_entry(newdir, direntbh, dirent);
+    dwarfs_write_buffer(&direntbh, newdir->i_sb);
+  }
+  return err;
 }
 
 int dwarfs_setattr(struct dentry *dentry, struct iattr *iattr) {
@@ -440,58 +674,60 @@ const struct inode_operations dwarfs_dir_inode_operations = {
 };
 
 /*
- * Function for reading a directory, one block at a time
+ * Function for reading a directory, one block at a time.
+ * ctx->pos is the byte offset of the next entry. If that entry was deleted and merged into
+ * the one before it since, reading goes on at the entry after.
  */
 static int dwarfs_read_dir(struct file *file, struct dir_context *ctx) {
   struct inode *inode = file_inode(file);
-  struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
   struct super_block *sb = inode->i_sb;
   struct buffer_head *bh = NULL;
   struct dwarfs_directory_entry *dirent = NULL;
-  char *limit = NULL;
-  int i = ctx->pos / sb->s_blocksize;
-
-  if(!dinode_i->inode_data[i]) return 0;
-  bh = sb_bread(sb, dinode_i->inode_data[i]);
-  if(!bh) {
-    printk("Dwarfs: Failed to get inode data buffer\n");
-    return -EIO;
-  }
-  dirent = (struct dwarfs_directory_entry *)bh->b_data;
-  limit = (char *)dirent + DWARFS_BLOCK_SIZE;
-  while((char *)dirent < limit && ctx->pos < inode->i_size) {
-    if(dirent->entrylen == 0) {
-      ctx->pos += sizeof(struct dwarfs_directory_entry);
-      dirent++;
-      continue;
-    }
-    if(dirent->inode) {
-      unsigned char d_type = DT_UNKNOWN;
-
-      if(!dir_emit(ctx, dirent->filename, dirent->namelen, le64_to_cpu(dirent->inode), d_type)) {
-        printk("Dwarfs: !dir_emit in read_dir: %s\n", dirent->filename);
-        brelse(bh);
-        return 0;
+  unsigned int offset, entryoff;
+  sector_t lblk;
+
+  if(dwarfs_dir_indexed(inode))
+    return dwarfs_dx_readdir(file, ctx);
+  while(ctx->pos < i_size_read(inode)) {
+    lblk = ctx->pos >> sb->s_blocksize_bits;
+    offset = ctx->pos & (sb->s_blocksize - 1);
+    bh = dwarfs_dir_bread(inode, lblk);
+    if(IS_ERR(bh))
+      return PTR_ERR(bh);
+    dirent = (struct dwarfs_directory_entry *)bh->b_data;
+    for( ; dirent; dirent = dwarfs_dir_next(inode, bh->b_data, lblk, dirent)) {
+      entryoff = (char *)dirent - bh->b_data;
+      if(entryoff < offset)
+        continue;
+      ctx->pos = ((loff_t)lblk << sb->s_blocksize_bits) + entryoff;
+      if(dirent->inode) {
+        if(!dir_emit(ctx, dirent->filename, dirent->namelen, le64_to_cpu(dirent->inode), fs_ftype_to_dtype(dirent->filetype))) {
+          brelse(bh);
+          return 0;
+        }
       }
     }
-    ctx->pos += sizeof(struct dwarfs_directory_entry);
-    dirent++;
+    brelse(bh);
+    ctx->pos = (loff_t)(lblk + 1) << sb->s_blocksize_bits;
   }
-  brelse(bh);
   return 0;
 }
 
-static long dwarfs_ioctl(struct file *fileptr, unsigned int cmd, unsigned long arg) {
-  printk("Dwarfs: ioctl not supported!\n");
-  return -EOPNOTSUPP;
-}
-
 static int dwarfs_fsync(struct file *file, loff_t start, loff_t end, int sync) {
   return generic_file_fsync(file, start, end, sync);
 }
 
+/* Indexed directories hand out hash cookies, which go past i_size */
+static loff_t dwarfs_dir_llseek(struct file *file, loff_t offset, int whence) {
+  struct inode *inode = file_inode(file);
+
+  if(dwarfs_dir_indexed(inode))
+    return generic_file_llseek_size(file, offset, whence, dwarfs_dx_eof(file), i_size_read(inode));
+  return generic_file_llseek(file, offset, whence);
+}
+
 const struct file_operations dwarfs_dir_operations = {
-  .llseek         = generic_file_llseek,
+  .llseek         = dwarfs_dir_llseek,
   .read           = generic_read_dir,
   .iterate_shared = dwarfs_read_dir,
   .unlocked_ioctl = dwarfs_ioctl,
@@ -5,12 +5,15 @@
 #include <linux/types.h>
 #include <linux/uidgid.h>
 #include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/percpu_counter.h>
+#include <linux/rwsem.h>
 #include <asm/spinlock.h>
 
 #define EFSCORRUPTED EUCLEAN
 #define EEXISTS 17 // Couldn't figure out where this is defined
 
-#define DWARFS_SUPERBLOCK_PADDING 3960 // 4096 - sizeof(dwarfs_superblock)
+#define DWARFS_SUPERBLOCK_PADDING 3952 // 4096 - sizeof(dwarfs_superblock)
 static const int DWARFS_BLOCK_SIZE = 4096; /* Size per block in bytes. */ 
 
 /*
@@ -19,6 +22,7 @@ static const int DWARFS_BLOCK_SIZE = 4096; /* Size per block in bytes. */
 
 static const unsigned long DWARFS_MAGIC = 0xDECAFBAD; /* Because copious amounts of caffeine is the only reason this is progressing at all */
 static const unsigned long DWARFS_SUPERBLOCK_BLOCKNUM = 0; 
+static const unsigned long DWARFS_VERSION = 2; /* On-disk format version, bumped on incompatible layout changes */
 
 extern struct file_system_type dwarfs_type;
 extern const struct super_operations dwarfs_super_operations;
@@ -51,16 +55,34 @@ struct dwarfs_superblock {
     __le64 dwarfs_version_num; /* Versions might not matter ... backwards/forwards compatibility???? */
     __le64 dwarfs_os; /* Which OS created the fs */
 
+    __le64 dwarfs_last_orphan; /* First inode on the orphan list, 0 if it's empty */
+
     char padding[DWARFS_SUPERBLOCK_PADDING];
 };
 
+/* A run of data bitmap blocks that is allocated from as a unit */
+struct dwarfs_alloc_group {
+    struct mutex lock; /* Protects the group's bitmap blocks and free counts */
+    uint64_t first_bitmap; /* First data bitmap block of the group */
+    uint64_t end_bitmap; /* One past the last data bitmap block of the group */
+    uint64_t next_free; /* No bitmap block of the group before this one has free bits */
+    uint64_t freec; /* Free data blocks in the group */
+};
+
+/* A run of contiguous blocks waiting to be freed */
+struct dwarfs_free_batch {
+    uint64_t start; /* First block of the run */
+    uint64_t len; /* Blocks in the run, 0 if empty */
+};
+
 /* DwarFS superblock in memory */
 struct dwarfs_superblock_info {
     uint64_t dwarfs_inodes_per_block; /* inodes per block */
     uint64_t dwarfs_sb_blocknum; /* block number of the superblock */
 
-    uint64_t dwarfs_free_inodes_count;
-    uint64_t dwarfs_free_blocks_count;
+    /* Free counts, folded into the on-disk superblock by sync_fs and statfs */
+    struct percpu_counter dwarfs_free_inodes_count;
+    struct percpu_counter dwarfs_free_blocks_count;
 
     struct buffer_head *dwarfs_bufferhead; /* Buffer Head containing the superblock */
     struct dwarfs_superblock *dfsb; /* Super block in the buffer */
@@ -71,9 +93,37 @@ struct dwarfs_superblock_info {
     kgid_t dwarfs_resgid; /* GID of reserved blocks */
     kuid_t dwarfs_resuid; /* UID of reserved blocks */
 
-    /* Added a second lock to try to get some more speed */
-    struct mutex dwarfs_bitmap_lock[30]; /* Lock to avoid data bitmap clashes */
+    /* In-memory summary of the data bitmap, built at mount time */
+    uint64_t dwarfs_data_bitmap_blocks; /* Number of data bitmap blocks */
+    uint32_t *dwarfs_bitmap_free; /* Free bits in each data bitmap block, protected by the group lock */
+
+    /* Data allocation groups, each CPU allocates from its own home group first */
+    struct dwarfs_alloc_group *dwarfs_groups;
+    unsigned int dwarfs_groupc; /* Number of allocation groups */
+    uint64_t dwarfs_bitmaps_per_group; /* Data bitmap blocks per allocation group */
+
     struct mutex dwarfs_inode_bitmap_lock; /* Lock to avoid inode bitmap clashes */
+    uint64_t dwarfs_inode_cursor; /* Next-fit cursor new directories are placed at */
+    uint64_t dwarfs_inode_first_free; /* No inode bitmap block before this one has free bits */
+
+    struct rb_root dwarfs_rsv_tree; /* Reservation windows of all inodes, sorted by first block */
+    spinlock_t dwarfs_rsv_lock; /* Protects the window tree */
+
+    atomic64_t dwarfs_delalloc_blocks; /* Blocks reserved by delayed allocations */
+    unsigned long dwarfs_mount_opt; /* DWARFS_MOUNT_* options */
+
+    /* Orphans, newest first like the on-disk list, and the worker freeing their blocks */
+    struct super_block *dwarfs_sb;
+    struct list_head dwarfs_orphans;
+    struct mutex dwarfs_orphan_lock; /* Protects the orphan list, in memory and on disk */
+    struct workqueue_struct *dwarfs_reclaim_wq;
+    struct work_struct dwarfs_reclaim_work;
+
+    /* Written back buffers of preallocated blocks, and the worker marking the blocks written */
+    spinlock_t dwarfs_unwritten_lock;
+    struct buffer_head *dwarfs_unwritten_list; /* Chained through b_private */
+    struct workqueue_struct *dwarfs_unwritten_wq;
+    struct work_struct dwarfs_unwritten_work;
 
 };
 
@@ -81,6 +131,14 @@ static inline struct dwarfs_superblock_info *DWARFS_SB(struct super_block *sb) {
 	return (struct dwarfs_superblock_info *)sb->s_fs_info;
 }
 
+/* Mount options */
+#define DWARFS_MOUNT_DELALLOC 0x0001 /* Delay allocation of buffered writes until writeback */
+#define DWARFS_MOUNT_DISCARD  0x0002 /* Discard blocks as they're freed */
+
+static inline bool dwarfs_test_opt(struct super_block *sb, unsigned long opt) {
+    return DWARFS_SB(sb)->dwarfs_mount_opt & opt;
+}
+
 /*
  * iNode code
  */
@@ -104,7 +162,21 @@ extern const struct inode_operations dwarfs_file_inode_operations;
 #define DWARFS_NUMBLOCKS 15 /* Total block ptrs in an inode */
 #define DWARFS_INODE_INDIR DWARFS_NUMBLOCKS-1
 
-#define DWARFS_INODE_PADDING 56
+/*
+ * Block pointers with this bit set refer to blocks preallocated by fallocate that
+ * were never written. They read back as zeroes until the first write clears the bit.
+ */
+#define DWARFS_BLOCK_UNWRITTEN (1ULL << 63)
+
+static inline __le64 dwarfs_blockptr_blockno(__le64 ptr) {
+    return ptr & ~DWARFS_BLOCK_UNWRITTEN;
+}
+
+/* Placeholder disk block of buffers whose allocation is delayed until writeback */
+#define DWARFS_DELALLOC_BLOCK (~(sector_t)0)
+#define DWARFS_MAX_DELALLOC_RUN 2048 /* Most blocks allocated at once for a delayed range */
+
+#define DWARFS_INODE_PADDING 40
 #define DWARFS_ROOT_INUM 2
 #define DWARFS_FIRST_INODE DWARFS_ROOT_INUM+1 
 /* Disk inode */
@@ -128,10 +200,74 @@ struct dwarfs_inode {
     __le64 inode_flags; /* File flags (Remove this if no flags get implemented!) */
     
     __le64 inode_blocks[DWARFS_NUMBLOCKS]; /* Pointers to data blocks */
+    __le64 inode_next_orphan; /* Next inode on the orphan list, 0 at the end */
+    __le64 inode_dir_start_lookup; /* First block of a linear directory that may have a free slot */
 
     uint8_t padding[DWARFS_INODE_PADDING]; /* Padding; can be used for any future additions */
 };
 
+/*
+ * Regular files and directories created with FS_EXTENT_FL set map their blocks through an
+ * extent tree rooted in inode_blocks, see extents.c. Other files use the direct pointers
+ * and the indirect list, other directories only the direct pointers.
+ */
+#define DWARFS_EXT_MAGIC 0xDF5E
+#define DWARFS_EXT_MAX_DEPTH 5
+#define DWARFS_EXT_UNWRITTEN 0x80000000U /* In ee_len, the extent was preallocated but never written */
+#define DWARFS_EXT_MAX_LEN 0x7FFFFFFFU
+
+/* Starts the root in the inode and every tree block */
+struct dwarfs_extent_header {
+    __le16 eh_magic;
+    __le16 eh_entries; /* Entries in use */
+    __le16 eh_max; /* Entries that fit */
+    __le16 eh_depth; /* 0 for leaves */
+};
+
+/* Leaf entry: logical blocks [ee_block, ee_block + len) live at disk blocks from ee_start */
+struct dwarfs_extent {
+    __le32 ee_block;
+    __le32 ee_len;
+    __le64 ee_start;
+};
+
+/* Index entry: the tree block one level down covering the blocks from ei_block */
+struct dwarfs_extent_idx {
+    __le32 ei_block;
+    __le32 ei_unused;
+    __le64 ei_node;
+};
+
+/* A deleted inode whose blocks are waiting to be freed by the reclaim worker */
+struct dwarfs_orphan {
+    struct list_head list;
+    uint64_t ino;
+    umode_t mode;
+    uint64_t flags; /* Inode flags, tell how the block pointers are laid out */
+    __le64 blocks[DWARFS_NUMBLOCKS]; /* Block pointers of the inode when it was evicted */
+};
+
+/* Window of upcoming data blocks an inode allocates from first, see alloc.c */
+struct dwarfs_rsv_window {
+    struct rb_node node; /* In the window tree of the mount */
+    uint64_t start; /* First block of the window, relative to the data start */
+    uint64_t end; /* One past the last block of the window, 0 if there is no window */
+    uint64_t goal_size; /* Size of the next window */
+};
+
+/* Last mapping looked up in an inode, and where it was in the indirect list, see inode.c */
+struct dwarfs_map_cache {
+    sector_t lblk; /* First logical block of the cached run */
+    unsigned long len; /* Blocks in the run, 0 if nothing is cached */
+    __le64 pblk; /* Block pointer of lblk, 0 for a hole */
+    sector_t list_depth; /* Position of the cached indirect list block, 0 if none */
+    __le64 list_block; /* Disk block of that list block */
+    unsigned long seq; /* Bumped whenever the mapping changes */
+};
+
+#define DWARFS_RSV_DEFAULT_WINDOW 8 /* Blocks in the first window of an inode */
+#define DWARFS_RSV_MAX_WINDOW 2048 /* Most blocks in a window */
+
 /* Memory inode */
 struct dwarfs_inode_info {
     uint64_t inode_dtime;
@@ -140,8 +276,15 @@ struct dwarfs_inode_info {
     uint64_t inode_flags;
 
     __le64 inode_data[DWARFS_NUMBLOCKS];
+    struct rw_semaphore inode_map_sem; /* Protects the extent tree */
+    struct dwarfs_map_cache inode_map_cache;
+    spinlock_t inode_map_cache_lock;
+
+    int64_t inode_dir_start_lookup; /* First block of a linear directory that may have a free slot */
+
+    struct dwarfs_rsv_window inode_rsv; /* Reservation window for file data */
+    struct mutex inode_rsv_lock; /* Serialises allocations from the window */
 
-    int64_t inode_dir_start_lookup;
     struct inode vfs_inode;
 };
 
@@ -149,6 +292,23 @@ static inline struct dwarfs_inode_info *DWARFS_INODE(struct inode *inode) {
     return container_of(inode, struct dwarfs_inode_info, vfs_inode);
 }
 
+/*
+ * Set once a file gets preallocated blocks. Its pages are then written back a page at a time,
+ * so the blocks can be marked written when the I/O completes. Kept above the FS_*_FL flags.
+ */
+#define DWARFS_UNWRITTEN_FL (1ULL << 33)
+
+static inline bool dwarfs_has_extents(struct inode *inode) {
+    return DWARFS_INODE(inode)->inode_flags & FS_EXTENT_FL;
+}
+
+/* Regular files up to this size keep their data in inode_blocks, see inline.c */
+#define DWARFS_INLINE_MAX (DWARFS_NUMBLOCKS * sizeof(__le64))
+
+static inline bool dwarfs_has_inline_data(struct inode *inode) {
+    return DWARFS_INODE(inode)->inode_flags & FS_INLINE_DATA_FL;
+}
+
 /*
  * File code
  */
@@ -159,14 +319,74 @@ static inline struct dwarfs_inode_info *DWARFS_INODE(struct inode *inode) {
 
 #define DWARFS_MAX_FILENAME_LEN 110
 
+/*
+ * Directories with DWARFS_DIRENT2_FL set hold variable length entries: the name follows
+ * the header directly, entrylen covers the entry and any free space after it, up to the
+ * next entry, and the entries of a block add up to the whole block. Unused entries have
+ * inode 0. Older directories use fixed size entries, with the whole struct per entry.
+ * The flag is kept above the FS_*_FL flags, it isn't for userspace.
+ */
+#define DWARFS_DIRENT2_FL (1ULL << 32)
+
 struct dwarfs_directory_entry {
     __le64 inode; /* inum */
     __le64 entrylen; /* length of the entry */
     uint8_t namelen; /* Length of the name */
-    uint8_t filetype; /* Filetype (directory, normal, etc.) */
+    uint8_t filetype; /* FT_* type of the inode, 0 (FT_UNKNOWN) in entries written by older versions */
     char filename[DWARFS_MAX_FILENAME_LEN]; /* File name */
 };
 
+/*
+ * Directories with FS_INDEX_FL set are hash indexed, see htree.c. The index root takes
+ * the rest of block 0 after DOT and DOTDOT. Index nodes below it use the same header.
+ */
+#define DWARFS_DX_MAGIC 0xD1D3
+#define DWARFS_DX_EOF ((loff_t)LLONG_MAX) /* readdir position after the last name */
+#define DWARFS_DX_EOF_32BIT ((loff_t)0x7FFFFFFF) /* The same for callers that keep 32 bit positions */
+
+struct dwarfs_dx_root {
+    __le16 dx_magic;
+    __le16 dx_count; /* Entries in use */
+    __le16 dx_limit; /* Entries that fit in the block */
+    __le16 dx_levels; /* Index levels below the root, at most 1. Always 0 in index nodes */
+};
+
+struct dwarfs_dx_entry {
+    __le32 dx_hash; /* Lowest hash of the names below the entry */
+    __le32 dx_block; /* Leaf or index node, counted from the start of the directory */
+};
+
+/* Directories are i_size long, one block is added at a time */
+static inline sector_t dwarfs_dir_blocks(struct inode *dir) {
+    return i_size_read(dir) >> dir->i_blkbits;
+}
+
+static inline bool dwarfs_dir_indexed(struct inode *dir) {
+    return DWARFS_INODE(dir)->inode_flags & FS_INDEX_FL;
+}
+
+static inline bool dwarfs_dir_varlen(struct inode *dir) {
+    return DWARFS_INODE(dir)->inode_flags & DWARFS_DIRENT2_FL;
+}
+
+/* Space an entry for a name of namelen takes up in dir */
+static inline unsigned int dwarfs_dir_rec_len(struct inode *dir, int namelen) {
+    if(!dwarfs_dir_varlen(dir))
+        return sizeof(struct dwarfs_directory_entry);
+    return ALIGN(offsetof(struct dwarfs_directory_entry, filename) + namelen, sizeof(__le64));
+}
+
+/* Fill in an entry found by dwarfs_dir_add_slot, which set up its entrylen */
+static inline void dwarfs_set_direntry(struct inode *dir, struct dwarfs_directory_entry *direntry, const char *name, int namelen, uint64_t ino, umode_t mode) {
+    if(!dwarfs_dir_varlen(dir)) {
+        memset(direntry->filename, 0, DWARFS_MAX_FILENAME_LEN);
+        direntry->entrylen = sizeof(struct dwarfs_directory_entry);
+    }
+    direntry->namelen = namelen;
+    memcpy(direntry->filename, name, namelen);
+    direntry->inode = cpu_to_le64(ino);
+    direntry->filetype = fs_umode_to_ftype(mode);
+}
 
 /* Function declarations */
 /* super.c */
@@ -189,17 +409,74 @@ extern int dwarfs_link_node(struct dentry *dentry, struct inode *inode);
 extern int dwarfs_sync_dinode(struct super_block *sb, struct inode *inode);
 extern void dwarfs_ievict(struct inode *inode);
 extern int dwarfs_iwrite(struct inode *inode, struct writeback_control *wbc);
+extern int dwarfs_prealloc_range(struct inode *inode, sector_t iblock, sector_t end);
+extern int dwarfs_free_range(struct inode *inode, sector_t iblock, sector_t end);
+extern void dwarfs_map_cache_invalidate(struct inode *inode, sector_t iblock, sector_t end, bool drop_list);
+extern int dwarfs_convert_range(struct inode *inode, sector_t iblock, sector_t end);
+extern int dwarfs_unwritten_init(struct super_block *sb);
+extern void dwarfs_unwritten_destroy(struct super_block *sb);
+extern const struct iomap_ops dwarfs_iomap_ops;
+extern vm_fault_t dwarfs_page_mkwrite(struct vm_fault *vmf);
 
 /* dir.c */
 extern int dwarfs_make_empty_dir(struct inode *inode, struct inode *dir);
 extern int dwarfs_getattr(const struct path *path, struct kstat *kstat, u32 req_mask, unsigned int query_flags);
 extern int dwarfs_setattr(struct dentry *dentry, struct iattr *iattr);
+extern struct buffer_head *dwarfs_dir_bread(struct inode *dir, sector_t lblk);
+extern struct buffer_head *dwarfs_dir_append_block(struct inode *dir, sector_t *lblk);
+extern struct dwarfs_directory_entry *dwarfs_dir_next(struct inode *dir, void *block, sector_t lblk, struct dwarfs_directory_entry *direntry);
+extern void dwarfs_dir_pack(struct inode *dir, void *block, struct dwarfs_directory_entry **entries, int count);
+extern struct dwarfs_directory_entry *dwarfs_dir_find_in_block(struct inode *dir, struct buffer_head *bh, sector_t lblk, const char *name, int namelen);
+extern bool dwarfs_dir_has_room(struct inode *dir, struct buffer_head *bh, sector_t lblk, int namelen);
+extern struct dwarfs_directory_entry *dwarfs_dir_add_slot(struct inode *dir, struct buffer_head *bh, sector_t lblk, int namelen);
+extern void dwarfs_dir_delete_entry(struct inode *dir, struct buffer_head *bh, struct dwarfs_directory_entry *direntry);
+extern struct dwarfs_directory_entry *dwarfs_find_entry(struct inode *dir, const char *name, int namelen, struct buffer_head **bhp);
 
 /* alloc.c */
-extern int64_t dwarfs_inode_alloc(struct super_block *sb);
+extern int64_t dwarfs_inode_alloc(struct super_block *sb, struct inode *dir, umode_t mode);
 extern int dwarfs_inode_dealloc(struct super_block *sb, int64_t ino);
 extern int64_t dwarfs_data_alloc(struct super_block *sb, struct inode *inode);
+extern int64_t dwarfs_data_alloc_blocks(struct super_block *sb, struct inode *inode, unsigned long *count);
+extern int dwarfs_data_free_blocks(struct super_block *sb, uint64_t blocknum, uint64_t count);
+extern int dwarfs_free_batch_add(struct super_block *sb, struct dwarfs_free_batch *batch, uint64_t blocknum);
+extern int dwarfs_free_batch_flush(struct super_block *sb, struct dwarfs_free_batch *batch);
+extern int dwarfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
 extern int dwarfs_data_dealloc(struct super_block *sb, struct inode *inode);
+extern int dwarfs_data_dealloc_blocks(struct super_block *sb, __le64 *blocks, uint64_t flags);
+extern int dwarfs_init_free_summary(struct super_block *sb);
+extern void dwarfs_destroy_free_summary(struct super_block *sb);
+extern void dwarfs_discard_window(struct inode *inode);
+extern int dwarfs_reserve_block(struct inode *inode, sector_t iblock);
+extern void dwarfs_release_block(struct inode *inode, sector_t iblock);
+
+/* extents.c */
+extern int dwarfs_ext_map(struct inode *inode, sector_t iblock, unsigned long max, __le64 *blockno, unsigned long *len);
+extern void dwarfs_ext_readahead(struct inode *inode, sector_t iblock);
+extern int dwarfs_ext_insert(struct inode *inode, sector_t iblock, uint64_t pblk, unsigned long len, bool unwritten, unsigned long *inserted);
+extern int dwarfs_ext_remove(struct inode *inode, sector_t iblock, sector_t end, struct dwarfs_free_batch *batch);
+extern int dwarfs_ext_convert(struct inode *inode, sector_t iblock, unsigned long len);
+extern int dwarfs_ext_dealloc(struct super_block *sb, __le64 *root, struct dwarfs_free_batch *batch);
+extern void dwarfs_ext_init(struct inode *inode);
+
+/* htree.c */
+extern struct dwarfs_directory_entry *dwarfs_dx_find(struct inode *dir, const char *name, int namelen, struct buffer_head **bhp);
+extern int dwarfs_dx_add_entry(struct inode *dir, const char *name, int namelen, uint64_t ino, umode_t mode);
+extern int dwarfs_dx_readdir(struct file *file, struct dir_context *ctx);
+extern loff_t dwarfs_dx_eof(struct file *file);
+extern int dwarfs_dx_convert(struct inode *dir);
+
+/* inline.c */
+extern int dwarfs_inline_readpage(struct inode *inode, struct page *page);
+extern int dwarfs_inline_writepage(struct page *page);
+extern int dwarfs_inline_write_begin(struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep);
+extern int dwarfs_inline_write_end(struct inode *inode, loff_t pos, unsigned int copied, struct page *page);
+extern int dwarfs_inline_convert(struct inode *inode);
+
+/* orphan.c */
+extern int dwarfs_orphan_init(struct super_block *sb);
+extern void dwarfs_orphan_destroy(struct super_block *sb);
+extern int dwarfs_orphan_add(struct inode *inode);
+extern int dwarfs_orphan_recover(struct super_block *sb);
 
 /* Operations */
 
@@ -218,6 +495,7 @@ static const struct inode_operations dwarfs_slow_symlink_inode_operations = {
 
 /* File */
 extern const struct file_operations dwarfs_file_operations;
+extern long dwarfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* inode */
 extern const struct inode_operations dwarfs_file_inode_operations;
@@ -261,8 +539,13 @@ static inline int dwarfs_datastart(struct super_block *sb) {
     return DWARFS_SB(sb)->dfsb->dwarfs_data_start_block;
 }
 
+/* Number of inodes or data blocks tracked by a single bitmap block, one per bit */
+static inline uint64_t dwarfs_bitmap_bits(struct super_block *sb) {
+    return sb->s_blocksize * BITS_PER_BYTE;
+}
+
 static inline struct buffer_head *read_inode_bitmap(struct super_block *sb, ino_t ino, uint64_t *bitblockno) {
-    uint64_t bitblocknum = DWARFS_SB(sb)->dfsb->dwarfs_inode_bitmap_start + (ino / sb->s_blocksize);
+    uint64_t bitblocknum = DWARFS_SB(sb)->dfsb->dwarfs_inode_bitmap_start + (ino / dwarfs_bitmap_bits(sb));
     if(bitblockno) *bitblockno = bitblocknum;
     return sb_bread(sb, bitblocknum);
 }
@@ -270,7 +553,7 @@ static inline struct buffer_head *read_inode_bitmap(struct super_block *sb, ino_
 static inline struct buffer_head *read_data_bitmap(struct super_block *sb, uint64_t blocknum, uint64_t *bitblockno) {
     uint64_t bitblocknum;
     blocknum -= dwarfs_datastart(sb);
-    bitblocknum = DWARFS_SB(sb)->dfsb->dwarfs_data_bitmap_start + (blocknum / sb->s_blocksize);
+    bitblocknum = DWARFS_SB(sb)->dfsb->dwarfs_data_bitmap_start + (blocknum / dwarfs_bitmap_bits(sb));
     if(bitblockno) *bitblockno = bitblocknum;
     return sb_bread(sb, bitblocknum);
 }
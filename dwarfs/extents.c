@@ -0,0 +1,690 @@
+#include <linux/buffer_head.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#include "dwarfs.h"
+
+/*
+ * Extent mapping for regular files and directories with FS_EXTENT_FL set.
+ * inode_data holds the root of a B-tree: a header followed by up to 7 entries. The entries
+ * of leaves (depth 0) are extents, runs of contiguous blocks. The entries of index nodes point
+ * to the tree blocks one level down, which have the same layout and fill a whole block.
+ * Entries are sorted by logical block. The key of an index entry is a lower bound for the
+ * blocks in its subtree and an upper bound for the subtree before it, except for the first
+ * entry of a node, which covers everything below the second one.
+ * A lookup costs one block read per level instead of a walk down the indirect list.
+ * The tree is protected by the inode's map semaphore.
+ */
+
+/* Position in the tree, one element per level starting at the root */
+struct dwarfs_ext_path {
+    struct buffer_head *bh; /* NULL for the root in the inode */
+    struct dwarfs_extent_header *hdr;
+    int pos; /* Last entry with a key at or before the block looked up, -1 if none */
+};
+
+#define DWARFS_EXT_FIRST(hdr) ((struct dwarfs_extent *)((hdr) + 1))
+#define DWARFS_EXT_FIRST_IDX(hdr) ((struct dwarfs_extent_idx *)((hdr) + 1))
+#define DWARFS_EXT_NONE ((uint64_t)1 << 32) /* Past the last logical block extents can map */
+
+static inline struct dwarfs_extent_header *dwarfs_ext_root(struct inode *inode) {
+    return (struct dwarfs_extent_header *)DWARFS_INODE(inode)->inode_data;
+}
+
+static inline uint16_t dwarfs_ext_root_max(void) {
+    return (sizeof(((struct dwarfs_inode_info *)0)->inode_data) - sizeof(struct dwarfs_extent_header)) / sizeof(struct dwarfs_extent);
+}
+
+static inline uint16_t dwarfs_ext_block_max(struct super_block *sb) {
+    return (sb->s_blocksize - sizeof(struct dwarfs_extent_header)) / sizeof(struct dwarfs_extent);
+}
+
+static inline uint32_t dwarfs_ext_len(struct dwarfs_extent *ex) {
+    return le32_to_cpu(ex->ee_len) & ~DWARFS_EXT_UNWRITTEN;
+}
+
+static inline bool dwarfs_ext_unwritten(struct dwarfs_extent *ex) {
+    return le32_to_cpu(ex->ee_len) & DWARFS_EXT_UNWRITTEN;
+}
+
+static inline void dwarfs_ext_set_len(struct dwarfs_extent *ex, uint32_t len, bool unwritten) {
+    ex->ee_len = cpu_to_le32(len | (unwritten ? DWARFS_EXT_UNWRITTEN : 0));
+}
+
+static inline uint32_t dwarfs_ext_key(struct dwarfs_extent_header *hdr, int i) {
+    if(hdr->eh_depth)
+        return le32_to_cpu(DWARFS_EXT_FIRST_IDX(hdr)[i].ei_block);
+    return le32_to_cpu(DWARFS_EXT_FIRST(hdr)[i].ee_block);
+}
+
+static inline bool dwarfs_ext_full(struct dwarfs_extent_header *hdr) {
+    return le16_to_cpu(hdr->eh_entries) >= le16_to_cpu(hdr->eh_max);
+}
+
+static inline bool dwarfs_ext_room(struct dwarfs_extent_header *hdr, int need) {
+    return le16_to_cpu(hdr->eh_entries) + need <= le16_to_cpu(hdr->eh_max);
+}
+
+/* Binary search for the last entry of a node with a key at or before iblock, -1 if none */
+static int dwarfs_ext_search(struct dwarfs_extent_header *hdr, uint32_t iblock) {
+    int lo = 0, hi = le16_to_cpu(hdr->eh_entries) - 1;
+    int mid, found = -1;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(dwarfs_ext_key(hdr, mid) <= iblock) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+static inline bool dwarfs_ext_valid_node(struct super_block *sb, uint64_t node) {
+    return node >= dwarfs_datastart(sb) && node < dwarfs_datastart(sb) + DWARFS_SB(sb)->dfsb->dwarfs_blockc;
+}
+
+/* The blocks of an extent must all be data blocks, or a corrupt tree could map metadata */
+static inline bool dwarfs_ext_valid_extent(struct super_block *sb, struct dwarfs_extent *ex) {
+    uint64_t start = le64_to_cpu(ex->ee_start);
+
+    return dwarfs_ext_len(ex) && dwarfs_ext_valid_node(sb, start) && start + dwarfs_ext_len(ex) <= dwarfs_datastart(sb) + DWARFS_SB(sb)->dfsb->dwarfs_blockc;
+}
+
+static int dwarfs_ext_check(struct super_block *sb, struct dwarfs_extent_header *hdr, uint16_t max, int depth) {
+    int i;
+
+    if(le16_to_cpu(hdr->eh_magic) != DWARFS_EXT_MAGIC || le16_to_cpu(hdr->eh_max) != max ||
+       le16_to_cpu(hdr->eh_entries) > max || le16_to_cpu(hdr->eh_depth) != depth) {
+        printk("Dwarfs: corrupt extent tree node at depth %d\n", depth);
+        return -EFSCORRUPTED;
+    }
+    for(i = 0; !depth && i < le16_to_cpu(hdr->eh_entries); i++) {
+        if(!dwarfs_ext_valid_extent(sb, DWARFS_EXT_FIRST(hdr) + i)) {
+            printk("Dwarfs: extent maps blocks outside the data blocks\n");
+            return -EFSCORRUPTED;
+        }
+    }
+    return 0;
+}
+
+static void dwarfs_ext_put_path(struct dwarfs_ext_path *path, int depth) {
+    int i;
+
+    for(i = 0; i <= depth; i++) {
+        brelse(path[i].bh);
+        path[i].bh = NULL;
+    }
+}
+
+/*
+ * Walk from the root down to the leaf that holds, or would hold, iblock.
+ * Returns the depth of the tree. The caller must put the path afterwards.
+ */
+static int dwarfs_ext_find(struct inode *inode, uint32_t iblock, struct dwarfs_ext_path *path) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_extent_header *hdr = dwarfs_ext_root(inode);
+    struct buffer_head *bh = NULL;
+    int depth = le16_to_cpu(hdr->eh_depth);
+    int level, err;
+    uint64_t node;
+
+    if(depth > DWARFS_EXT_MAX_DEPTH || dwarfs_ext_check(sb, hdr, dwarfs_ext_root_max(), depth))
+        return -EFSCORRUPTED;
+    memset(path, 0, sizeof(struct dwarfs_ext_path) * (depth + 1));
+
+    for(level = 0; ; level++) {
+        path[level].hdr = hdr;
+        path[level].pos = dwarfs_ext_search(hdr, iblock);
+        if(level == depth)
+            break;
+        if(!hdr->eh_entries) {
+            err = -EFSCORRUPTED;
+            goto fail;
+        }
+        if(path[level].pos < 0)
+            path[level].pos = 0;
+        node = le64_to_cpu(DWARFS_EXT_FIRST_IDX(hdr)[path[level].pos].ei_node);
+        if(!dwarfs_ext_valid_node(sb, node)) {
+            printk("Dwarfs: extent tree of inode %lu points outside the data blocks\n", inode->i_ino);
+            err = -EFSCORRUPTED;
+            goto fail;
+        }
+        if(!(bh = sb_bread(sb, node))) {
+            err = -EIO;
+            goto fail;
+        }
+        path[level + 1].bh = bh;
+        hdr = (struct dwarfs_extent_header *)bh->b_data;
+        if((err = dwarfs_ext_check(sb, hdr, dwarfs_ext_block_max(sb), depth - level - 1)))
+            goto fail;
+    }
+    return depth;
+
+fail:
+    dwarfs_ext_put_path(path, depth);
+    return err;
+}
+
+/* First logical block that may be mapped after the position of the path */
+static uint64_t dwarfs_ext_next(struct dwarfs_ext_path *path, int depth) {
+    int level;
+
+    for(level = depth; level >= 0; level--) {
+        if(path[level].pos + 1 < le16_to_cpu(path[level].hdr->eh_entries))
+            return dwarfs_ext_key(path[level].hdr, path[level].pos + 1);
+    }
+    return DWARFS_EXT_NONE;
+}
+
+static void dwarfs_ext_dirty(struct inode *inode, struct dwarfs_ext_path *path, int level) {
+    if(!path[level].bh) {
+        mark_inode_dirty(inode);
+        return;
+    }
+    mark_buffer_dirty(path[level].bh);
+    if(inode->i_sb->s_flags & SB_SYNCHRONOUS)
+        sync_dirty_buffer(path[level].bh);
+}
+
+/*
+ * Map logical block iblock. *blockno is set to the disk block, with DWARFS_BLOCK_UNWRITTEN
+ * set for preallocated blocks, or to 0 for a hole. *len is set to the number of blocks,
+ * at most max, that follow in the same state: contiguous on disk, or in the same hole.
+ */
+int dwarfs_ext_map(struct inode *inode, sector_t iblock, unsigned long max, __le64 *blockno, unsigned long *len) {
+    struct dwarfs_ext_path path[DWARFS_EXT_MAX_DEPTH + 1];
+    struct dwarfs_extent *ex = NULL;
+    uint64_t off;
+    int depth;
+
+    *blockno = 0;
+    *len = 1;
+    if(iblock >= DWARFS_EXT_NONE)
+        return 0;
+
+    down_read(&DWARFS_INODE(inode)->inode_map_sem);
+    if((depth = dwarfs_ext_find(inode, iblock, path)) < 0) {
+        up_read(&DWARFS_INODE(inode)->inode_map_sem);
+        return depth;
+    }
+    if(path[depth].pos >= 0) {
+        ex = DWARFS_EXT_FIRST(path[depth].hdr) + path[depth].pos;
+        off = iblock - le32_to_cpu(ex->ee_block);
+        if(off < dwarfs_ext_len(ex)) {
+            *blockno = (le64_to_cpu(ex->ee_start) + off) | (dwarfs_ext_unwritten(ex) ? DWARFS_BLOCK_UNWRITTEN : 0);
+            *len = min_t(uint64_t, max, dwarfs_ext_len(ex) - off);
+            goto out;
+        }
+    }
+    *len = min_t(uint64_t, max, dwarfs_ext_next(path, depth) - iblock);
+out:
+    dwarfs_ext_put_path(path, depth);
+    up_read(&DWARFS_INODE(inode)->inode_map_sem);
+    return 0;
+}
+
+/*
+ * Start reading the leaf that maps iblock, so mapping the next readahead window
+ * doesn't wait for it. Index nodes above it are read as usual, they are usually cached.
+ */
+void dwarfs_ext_readahead(struct inode *inode, sector_t iblock) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_extent_header *hdr = dwarfs_ext_root(inode);
+    struct buffer_head *bh = NULL;
+    int depth = le16_to_cpu(hdr->eh_depth);
+    int level, pos;
+    uint64_t node;
+
+    if(!depth || iblock >= DWARFS_EXT_NONE)
+        return;
+
+    down_read(&DWARFS_INODE(inode)->inode_map_sem);
+    if(depth > DWARFS_EXT_MAX_DEPTH || dwarfs_ext_check(sb, hdr, dwarfs_ext_root_max(), depth))
+        goto out;
+    for(level = 0; hdr->eh_entries; level++) {
+        pos = max(dwarfs_ext_search(hdr, iblock), 0);
+        node = le64_to_cpu(DWARFS_EXT_FIRST_IDX(hdr)[pos].ei_node);
+        if(!dwarfs_ext_valid_node(sb, node))
+            break;
+        if(level == depth - 1) {
+            sb_breadahead(sb, node);
+            break;
+        }
+        brelse(bh);
+        if(!(bh = sb_bread(sb, node)))
+            break;
+        hdr = (struct dwarfs_extent_header *)bh->b_data;
+        if(dwarfs_ext_check(sb, hdr, dwarfs_ext_block_max(sb), depth - level - 1))
+            break;
+    }
+    brelse(bh);
+out:
+    up_read(&DWARFS_INODE(inode)->inode_map_sem);
+}
+
+/* Move the root into a new tree block, which makes the tree one level deeper */
+static int dwarfs_ext_grow(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_extent_header *root = dwarfs_ext_root(inode);
+    struct dwarfs_extent_header *hdr = NULL;
+    struct dwarfs_extent_idx *idx = NULL;
+    struct buffer_head *bh = NULL;
+    int depth = le16_to_cpu(root->eh_depth);
+    int64_t node;
+
+    if(depth >= DWARFS_EXT_MAX_DEPTH)
+        return -EFBIG;
+    if((node = dwarfs_data_alloc(sb, inode)) < 0)
+        return node;
+    if(!(bh = sb_bread(sb, node)))
+        return -EIO;
+    hdr = (struct dwarfs_extent_header *)bh->b_data;
+    memcpy(hdr, root, sizeof(struct dwarfs_extent_header) + le16_to_cpu(root->eh_entries) * sizeof(struct dwarfs_extent));
+    hdr->eh_max = cpu_to_le16(dwarfs_ext_block_max(sb));
+    dwarfs_write_buffer(&bh, sb);
+
+    idx = DWARFS_EXT_FIRST_IDX(root);
+    idx->ei_block = 0;
+    idx->ei_unused = 0;
+    idx->ei_node = cpu_to_le64(node);
+    root->eh_entries = cpu_to_le16(1);
+    root->eh_depth = cpu_to_le16(depth + 1);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * Split the full node at the given level of the path, and add the new node to its parent,
+ * which must have room. When appending, a leaf whose last extent is the one looked up
+ * isn't split in half, the new extent starts a new leaf instead, so files written
+ * sequentially get full leaves.
+ */
+static int dwarfs_ext_split(struct inode *inode, struct dwarfs_ext_path *path, int level, uint32_t iblock, bool append) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_extent_header *hdr = path[level].hdr;
+    struct dwarfs_extent_header *parent = path[level - 1].hdr;
+    struct dwarfs_extent_header *nhdr = NULL;
+    struct dwarfs_extent_idx *idx = NULL;
+    struct buffer_head *nbh = NULL;
+    int entries = le16_to_cpu(hdr->eh_entries);
+    int pentries = le16_to_cpu(parent->eh_entries);
+    int ppos = path[level - 1].pos;
+    int keep;
+    uint32_t key;
+    int64_t node;
+
+    if(append && !hdr->eh_depth && path[level].pos == entries - 1) {
+        keep = entries;
+        key = iblock;
+    } else {
+        keep = entries / 2;
+        key = dwarfs_ext_key(hdr, keep);
+    }
+
+    if((node = dwarfs_data_alloc(sb, inode)) < 0)
+        return node;
+    if(!(nbh = sb_bread(sb, node)))
+        return -EIO;
+    nhdr = (struct dwarfs_extent_header *)nbh->b_data;
+    nhdr->eh_magic = cpu_to_le16(DWARFS_EXT_MAGIC);
+    nhdr->eh_max = cpu_to_le16(dwarfs_ext_block_max(sb));
+    nhdr->eh_depth = hdr->eh_depth;
+    nhdr->eh_entries = cpu_to_le16(entries - keep);
+    memcpy(DWARFS_EXT_FIRST(nhdr), DWARFS_EXT_FIRST(hdr) + keep, (entries - keep) * sizeof(struct dwarfs_extent));
+    dwarfs_write_buffer(&nbh, sb);
+
+    hdr->eh_entries = cpu_to_le16(keep);
+    dwarfs_ext_dirty(inode, path, level);
+
+    idx = DWARFS_EXT_FIRST_IDX(parent) + ppos + 1;
+    memmove(idx + 1, idx, (pentries - ppos - 1) * sizeof(struct dwarfs_extent_idx));
+    idx->ei_block = cpu_to_le32(key);
+    idx->ei_unused = 0;
+    idx->ei_node = cpu_to_le64(node);
+    parent->eh_entries = cpu_to_le16(pentries + 1);
+    dwarfs_ext_dirty(inode, path, level - 1);
+    return 0;
+}
+
+/*
+ * Make room for need more entries in the leaf of the path, which doesn't have it: split
+ * the highest full node below one with room, or grow the tree. What the tree maps doesn't
+ * change, and the new tree block is allocated before anything is touched, so on failure
+ * the tree is as it was. The path is put either way, the caller has to look it up again.
+ */
+static int dwarfs_ext_make_room(struct inode *inode, struct dwarfs_ext_path *path, int depth, uint32_t iblock, bool append) {
+    int level, err;
+
+    for(level = depth - 1; level >= 0 && dwarfs_ext_full(path[level].hdr); level--)
+        ;
+    err = level < 0 ? dwarfs_ext_grow(inode) : dwarfs_ext_split(inode, path, level + 1, iblock, append);
+    dwarfs_ext_put_path(path, depth);
+    return err;
+}
+
+/*
+ * Map the unmapped logical blocks [iblock, iblock + len) to the disk blocks starting at pblk.
+ * The run is merged into a neighbouring extent when it continues it on disk. A run that
+ * crosses the key of the next subtree is split there, so every block stays where lookups go.
+ * Every part is in the tree once it's inserted, *inserted counts the blocks mapped even
+ * when a later part fails.
+ */
+static int __dwarfs_ext_insert(struct inode *inode, uint32_t iblock, uint64_t pblk, uint32_t len, bool unwritten, unsigned long *inserted) {
+    struct dwarfs_ext_path path[DWARFS_EXT_MAX_DEPTH + 1];
+    struct dwarfs_extent_header *leaf = NULL;
+    struct dwarfs_extent *ex = NULL;
+    int depth, pos, entries, err;
+    uint32_t part;
+
+    *inserted = 0;
+    while(len) {
+        if((depth = dwarfs_ext_find(inode, iblock, path)) < 0)
+            return depth;
+        leaf = path[depth].hdr;
+        pos = path[depth].pos;
+        entries = le16_to_cpu(leaf->eh_entries);
+        part = min_t(uint64_t, len, dwarfs_ext_next(path, depth) - iblock);
+
+        if(pos >= 0) { // Continues the extent before it?
+            ex = DWARFS_EXT_FIRST(leaf) + pos;
+            if(dwarfs_ext_unwritten(ex) == unwritten && le32_to_cpu(ex->ee_block) + dwarfs_ext_len(ex) == iblock &&
+               le64_to_cpu(ex->ee_start) + dwarfs_ext_len(ex) == pblk && dwarfs_ext_len(ex) + part <= DWARFS_EXT_MAX_LEN) {
+                dwarfs_ext_set_len(ex, dwarfs_ext_len(ex) + part, unwritten);
+                goto inserted;
+            }
+        }
+        if(pos + 1 < entries) { // Runs right into the extent after it?
+            ex = DWARFS_EXT_FIRST(leaf) + pos + 1;
+            if(dwarfs_ext_unwritten(ex) == unwritten && iblock + part == le32_to_cpu(ex->ee_block) &&
+               pblk + part == le64_to_cpu(ex->ee_start) && dwarfs_ext_len(ex) + part <= DWARFS_EXT_MAX_LEN) {
+                ex->ee_block = cpu_to_le32(iblock);
+                ex->ee_start = cpu_to_le64(pblk);
+                dwarfs_ext_set_len(ex, dwarfs_ext_len(ex) + part, unwritten);
+                goto inserted;
+            }
+        }
+        if(!dwarfs_ext_full(leaf)) {
+            ex = DWARFS_EXT_FIRST(leaf) + pos + 1;
+            memmove(ex + 1, ex, (entries - pos - 1) * sizeof(struct dwarfs_extent));
+            ex->ee_block = cpu_to_le32(iblock);
+            ex->ee_start = cpu_to_le64(pblk);
+            dwarfs_ext_set_len(ex, part, unwritten);
+            leaf->eh_entries = cpu_to_le16(entries + 1);
+            goto inserted;
+        }
+
+        if((err = dwarfs_ext_make_room(inode, path, depth, iblock, true)))
+            return err;
+        continue;
+
+inserted:
+        dwarfs_ext_dirty(inode, path, depth);
+        dwarfs_ext_put_path(path, depth);
+        iblock += part;
+        pblk += part;
+        len -= part;
+        *inserted += part;
+    }
+    return 0;
+}
+
+int dwarfs_ext_insert(struct inode *inode, sector_t iblock, uint64_t pblk, unsigned long len, bool unwritten, unsigned long *inserted) {
+    int err;
+
+    *inserted = 0;
+    if(iblock + len > DWARFS_EXT_NONE || len > DWARFS_EXT_MAX_LEN)
+        return -EFBIG;
+    down_write(&DWARFS_INODE(inode)->inode_map_sem);
+    err = __dwarfs_ext_insert(inode, iblock, pblk, len, unwritten, inserted);
+    up_write(&DWARFS_INODE(inode)->inode_map_sem);
+    return err;
+}
+
+/*
+ * Unmap the logical blocks [iblock, end). If batch is set the disk blocks are freed
+ * through it, otherwise they are only dropped from the tree.
+ * Cutting a range out of the middle of an extent needs another entry for its end, room
+ * for it is made before the extent is touched, so a failure never unmaps the end.
+ * Empty leaves are kept, they're reused when the range is mapped again.
+ */
+static int __dwarfs_ext_remove(struct inode *inode, uint64_t iblock, uint64_t end, struct dwarfs_free_batch *batch) {
+    struct dwarfs_ext_path path[DWARFS_EXT_MAX_DEPTH + 1];
+    struct dwarfs_extent_header *leaf = NULL;
+    struct dwarfs_extent *ex = NULL;
+    uint64_t exstart, exend, pstart, cut, b, next;
+    bool unwritten;
+    int depth, pos, entries, ret, err = 0;
+
+    end = min(end, DWARFS_EXT_NONE);
+    while(iblock < end) {
+        if((depth = dwarfs_ext_find(inode, iblock, path)) < 0)
+            return depth;
+        leaf = path[depth].hdr;
+        pos = path[depth].pos;
+        entries = le16_to_cpu(leaf->eh_entries);
+        ex = pos >= 0 ? DWARFS_EXT_FIRST(leaf) + pos : NULL;
+
+        if(!ex || iblock >= le32_to_cpu(ex->ee_block) + dwarfs_ext_len(ex)) { // In a hole, skip it
+            next = dwarfs_ext_next(path, depth);
+            dwarfs_ext_put_path(path, depth);
+            iblock = next;
+            continue;
+        }
+        exstart = le32_to_cpu(ex->ee_block);
+        exend = exstart + dwarfs_ext_len(ex);
+        pstart = le64_to_cpu(ex->ee_start);
+        unwritten = dwarfs_ext_unwritten(ex);
+        cut = min(end, exend);
+
+        if(iblock > exstart && cut < exend && !dwarfs_ext_room(leaf, 1)) {
+            if((ret = dwarfs_ext_make_room(inode, path, depth, iblock, false)))
+                return ret;
+            continue;
+        }
+        if(batch) { // The extent loses the blocks either way, so keep batching them after an error
+            for(b = pstart + (iblock - exstart); b < pstart + (cut - exstart); b++)
+                if((ret = dwarfs_free_batch_add(inode->i_sb, batch, b)) && !err)
+                    err = ret;
+            inode->i_blocks -= cut - iblock;
+            mark_inode_dirty(inode);
+        }
+
+        if(iblock == exstart && cut == exend) {
+            memmove(ex, ex + 1, (entries - pos - 1) * sizeof(struct dwarfs_extent));
+            leaf->eh_entries = cpu_to_le16(entries - 1);
+        } else if(iblock == exstart) {
+            ex->ee_block = cpu_to_le32(cut);
+            ex->ee_start = cpu_to_le64(pstart + (cut - exstart));
+            dwarfs_ext_set_len(ex, exend - cut, unwritten);
+        } else {
+            dwarfs_ext_set_len(ex, iblock - exstart, unwritten);
+            if(cut < exend) { // Cut out of the middle, the end of the extent becomes a new one
+                memmove(ex + 2, ex + 1, (entries - pos - 1) * sizeof(struct dwarfs_extent));
+                ex[1].ee_block = cpu_to_le32(cut);
+                ex[1].ee_start = cpu_to_le64(pstart + (cut - exstart));
+                dwarfs_ext_set_len(ex + 1, exend - cut, unwritten);
+                leaf->eh_entries = cpu_to_le16(entries + 1);
+            }
+        }
+        dwarfs_ext_dirty(inode, path, depth);
+        dwarfs_ext_put_path(path, depth);
+        if(err)
+            return err;
+        iblock = cut;
+    }
+    return 0;
+}
+
+int dwarfs_ext_remove(struct inode *inode, sector_t iblock, sector_t end, struct dwarfs_free_batch *batch) {
+    int err;
+
+    down_write(&DWARFS_INODE(inode)->inode_map_sem);
+    err = __dwarfs_ext_remove(inode, iblock, end, batch);
+    up_write(&DWARFS_INODE(inode)->inode_map_sem);
+    return err;
+}
+
+/*
+ * Can the extent a take on the written blocks [iblock, iblock + len) backed from pblk,
+ * which follow it or precede it directly?
+ */
+static inline bool dwarfs_ext_joins(struct dwarfs_extent *a, uint32_t iblock, uint64_t pblk, uint32_t len, bool after) {
+    if(dwarfs_ext_unwritten(a) || dwarfs_ext_len(a) + len > DWARFS_EXT_MAX_LEN)
+        return false;
+    if(after)
+        return le32_to_cpu(a->ee_block) + dwarfs_ext_len(a) == iblock && le64_to_cpu(a->ee_start) + dwarfs_ext_len(a) == pblk;
+    return iblock + len == le32_to_cpu(a->ee_block) && pblk + len == le64_to_cpu(a->ee_start);
+}
+
+/*
+ * First write to the preallocated blocks among logical blocks [iblock, iblock + len):
+ * mark them written. The unwritten flag is flipped in place, an extent that is only
+ * partly written is split in its leaf, and the written part joins a written neighbour
+ * in the same leaf when it continues it. Room for the split is made before the extent
+ * is touched, so a failure leaves every block mapped, some of them still unwritten.
+ */
+static int __dwarfs_ext_convert(struct inode *inode, uint64_t iblock, uint64_t end) {
+    struct dwarfs_ext_path path[DWARFS_EXT_MAX_DEPTH + 1];
+    struct dwarfs_extent_header *leaf = NULL;
+    struct dwarfs_extent *ex = NULL;
+    struct dwarfs_extent parts[3];
+    uint64_t exstart, exend, pstart, cut, next;
+    int depth, pos, entries, n, drop, err;
+    bool joinprev, joinnext;
+
+    end = min(end, DWARFS_EXT_NONE);
+    while(iblock < end) {
+        if((depth = dwarfs_ext_find(inode, iblock, path)) < 0)
+            return depth;
+        leaf = path[depth].hdr;
+        pos = path[depth].pos;
+        entries = le16_to_cpu(leaf->eh_entries);
+        ex = pos >= 0 ? DWARFS_EXT_FIRST(leaf) + pos : NULL;
+
+        if(!ex || iblock >= le32_to_cpu(ex->ee_block) + dwarfs_ext_len(ex) || !dwarfs_ext_unwritten(ex)) {
+            next = ex && iblock < le32_to_cpu(ex->ee_block) + dwarfs_ext_len(ex) ?
+                   le32_to_cpu(ex->ee_block) + dwarfs_ext_len(ex) : dwarfs_ext_next(path, depth);
+            dwarfs_ext_put_path(path, depth);
+            iblock = next;
+            continue;
+        }
+        exstart = le32_to_cpu(ex->ee_block);
+        exend = exstart + dwarfs_ext_len(ex);
+        pstart = le64_to_cpu(ex->ee_start);
+        cut = min(end, exend);
+        joinprev = iblock == exstart && pos > 0 &&
+                   dwarfs_ext_joins(ex - 1, iblock, pstart, cut - iblock, true);
+        joinnext = !joinprev && cut == exend && pos + 1 < entries &&
+                   dwarfs_ext_joins(ex + 1, iblock, pstart + (iblock - exstart), cut - iblock, false);
+
+        // The extent becomes up to three: unwritten before iblock, written, unwritten after cut
+        n = 0;
+        if(iblock > exstart) {
+            parts[n] = *ex;
+            dwarfs_ext_set_len(parts + n++, iblock - exstart, true);
+        }
+        if(!joinprev && !joinnext) {
+            parts[n].ee_block = cpu_to_le32(iblock);
+            parts[n].ee_start = cpu_to_le64(pstart + (iblock - exstart));
+            dwarfs_ext_set_len(parts + n++, cut - iblock, false);
+        }
+        if(cut < exend) {
+            parts[n].ee_block = cpu_to_le32(cut);
+            parts[n].ee_start = cpu_to_le64(pstart + (cut - exstart));
+            dwarfs_ext_set_len(parts + n++, exend - cut, true);
+        }
+        if(n > 1 && !dwarfs_ext_room(leaf, n - 1)) {
+            if((err = dwarfs_ext_make_room(inode, path, depth, iblock, false)))
+                return err;
+            continue;
+        }
+
+        drop = 0;
+        if(joinprev) {
+            dwarfs_ext_set_len(ex - 1, dwarfs_ext_len(ex - 1) + (cut - iblock), false);
+            if(!n && pos + 1 < entries && !dwarfs_ext_unwritten(ex + 1) && dwarfs_ext_joins(ex - 1,
+               le32_to_cpu(ex[1].ee_block), le64_to_cpu(ex[1].ee_start), dwarfs_ext_len(ex + 1), true)) {
+                // The last unwritten gap between two written extents is gone, they become one
+                dwarfs_ext_set_len(ex - 1, dwarfs_ext_len(ex - 1) + dwarfs_ext_len(ex + 1), false);
+                drop = 1;
+            }
+        }
+        if(joinnext) {
+            ex[1].ee_block = cpu_to_le32(iblock);
+            ex[1].ee_start = cpu_to_le64(pstart + (iblock - exstart));
+            dwarfs_ext_set_len(ex + 1, dwarfs_ext_len(ex + 1) + (cut - iblock), false);
+        }
+        memmove(ex + n, ex + 1 + drop, (entries - pos - 1 - drop) * sizeof(struct dwarfs_extent));
+        memcpy(ex, parts, n * sizeof(struct dwarfs_extent));
+        leaf->eh_entries = cpu_to_le16(entries + n - 1 - drop);
+        dwarfs_ext_dirty(inode, path, depth);
+        dwarfs_ext_put_path(path, depth);
+        iblock = cut;
+    }
+    return 0;
+}
+
+int dwarfs_ext_convert(struct inode *inode, sector_t iblock, unsigned long len) {
+    int err;
+
+    down_write(&DWARFS_INODE(inode)->inode_map_sem);
+    err = __dwarfs_ext_convert(inode, iblock, iblock + len);
+    up_write(&DWARFS_INODE(inode)->inode_map_sem);
+    return err;
+}
+
+static int dwarfs_ext_free_node(struct super_block *sb, struct dwarfs_extent_header *hdr, int depth, struct dwarfs_free_batch *batch) {
+    struct dwarfs_extent *ex = DWARFS_EXT_FIRST(hdr);
+    struct dwarfs_extent_idx *idx = DWARFS_EXT_FIRST_IDX(hdr);
+    struct buffer_head *bh = NULL;
+    int entries = le16_to_cpu(hdr->eh_entries);
+    uint64_t node, b;
+    int i, err = 0;
+
+    for(i = 0; i < entries && !err; i++) {
+        if(!depth) {
+            for(b = 0; b < dwarfs_ext_len(ex + i) && !err; b++)
+                err = dwarfs_free_batch_add(sb, batch, le64_to_cpu(ex[i].ee_start) + b);
+            continue;
+        }
+        node = le64_to_cpu(idx[i].ei_node);
+        if(!dwarfs_ext_valid_node(sb, node))
+            return -EFSCORRUPTED;
+        if(!(bh = sb_bread(sb, node)))
+            return -EIO;
+        err = dwarfs_ext_check(sb, (struct dwarfs_extent_header *)bh->b_data, dwarfs_ext_block_max(sb), depth - 1);
+        if(!err)
+            err = dwarfs_ext_free_node(sb, (struct dwarfs_extent_header *)bh->b_data, depth - 1, batch);
+        bforget(bh); // The tree block is going away, don't write it back
+        if(!err)
+            err = dwarfs_free_batch_add(sb, batch, node);
+        cond_resched();
+    }
+    return err;
+}
+
+/*
+ * Free every data and tree block of the extent tree rooted at root.
+ */
+int dwarfs_ext_dealloc(struct super_block *sb, __le64 *root, struct dwarfs_free_batch *batch) {
+    struct dwarfs_extent_header *hdr = (struct dwarfs_extent_header *)root;
+    int depth = le16_to_cpu(hdr->eh_depth);
+
+    if(depth > DWARFS_EXT_MAX_DEPTH || dwarfs_ext_check(sb, hdr, dwarfs_ext_root_max(), depth))
+        return -EFSCORRUPTED;
+    return dwarfs_ext_free_node(sb, hdr, depth, batch);
+}
+
+/* Start an empty extent tree in a new inode */
+void dwarfs_ext_init(struct inode *inode) {
+    struct dwarfs_extent_header *root = dwarfs_ext_root(inode);
+
+    memset(DWARFS_INODE(inode)->inode_data, 0, sizeof(DWARFS_INODE(inode)->inode_data));
+    root->eh_magic = cpu_to_le16(DWARFS_EXT_MAGIC);
+    root->eh_entries = 0;
+    root->eh_max = cpu_to_le16(dwarfs_ext_root_max());
+    root->eh_depth = 0;
+}
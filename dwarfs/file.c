@@ -3,11 +3,15 @@
 #include <linux/fs.h>
 #include <linux/quotaops.h>
 #include <linux/aio.h>
+#include <linux/blkdev.h>
+#include <linux/uaccess.h>
+#include <linux/iomap.h>
+#include <linux/uio.h>
 
 /* This doesn't work at all, keep out of the Makefile */
 
 int dwarfs_fiemap(struct inode *inode, struct fiemap_extent_info *finfo, uint64_t start, uint64_t len) {
-  return generic_block_fiemap(inode, finfo, start, len, dwarfs_get_iblock);
+  return iomap_fiemap(inode, finfo, start, len, &dwarfs_iomap_ops);
 }
 
 const struct inode_operations dwarfs_file_inode_operations = {
@@ -16,29 +20,303 @@ const struct inode_operations dwarfs_file_inode_operations = {
     .fiemap         = dwarfs_fiemap,
 };
 
+static ssize_t dwarfs_dio_read_iter(struct kiocb *iocb, struct iov_iter *iter) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  ssize_t ret;
+
+  if(!iov_iter_count(iter))
+    return 0;
+  inode_lock_shared(inode);
+  ret = iomap_dio_rw(iocb, iter, &dwarfs_iomap_ops, NULL);
+  inode_unlock_shared(inode);
+  file_accessed(iocb->ki_filp);
+  return ret;
+}
+
+/*
+ * Direct writes into holes land in unwritten blocks, see dwarfs_iomap_begin.
+ * Once the data is on disk they're marked written, and the file grows if the write
+ * went past its end.
+ */
+static int dwarfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned int flags) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t end = iocb->ki_pos + size;
+  int err;
+
+  if(error)
+    return error;
+  if(size <= 0)
+    return 0;
+  if(flags & IOMAP_DIO_UNWRITTEN) {
+    if((err = dwarfs_convert_range(inode, iocb->ki_pos >> blkbits, (end + (1 << blkbits) - 1) >> blkbits)))
+      return err;
+  }
+  if(end > i_size_read(inode)) {
+    i_size_write(inode, end);
+    mark_inode_dirty(inode);
+  }
+  return 0;
+}
+
+static const struct iomap_dio_ops dwarfs_dio_write_ops = {
+  .end_io = dwarfs_dio_write_end_io,
+};
+
+static ssize_t dwarfs_dio_write_iter(struct kiocb *iocb, struct iov_iter *iter) {
+  struct file *file = iocb->ki_filp;
+  struct inode *inode = file_inode(file);
+  ssize_t ret;
+
+  inode_lock(inode);
+  ret = generic_write_checks(iocb, iter);
+  if(ret <= 0)
+    goto out;
+  if((ret = file_remove_privs(file)) || (ret = file_update_time(file)))
+    goto out;
+  ret = iomap_dio_rw(iocb, iter, &dwarfs_iomap_ops, &dwarfs_dio_write_ops);
+out:
+  inode_unlock(inode);
+  if(ret > 0)
+    ret = generic_write_sync(iocb, ret);
+  return ret;
+}
+
+/* Inline files have no blocks to do direct I/O to, so they always go through the page cache */
 ssize_t dwarfs_file_read_iter (struct kiocb * iocb, struct iov_iter * iter) {
+  if(dwarfs_has_inline_data(file_inode(iocb->ki_filp)))
+    iocb->ki_flags &= ~IOCB_DIRECT;
+  if(iocb->ki_flags & IOCB_DIRECT)
+    return dwarfs_dio_read_iter(iocb, iter);
   return generic_file_read_iter(iocb, iter);
 }
 
+/*
+ * Buffered writes map their blocks through iomap_begin, with buffer heads left on the
+ * pages for writepage. Inline files keep write_begin, which copies into the inode.
+ * Delalloc mounts keep write_begin too: iomap maps the buffers of a page from the extent
+ * without calling back per buffer, so a block reserved in iomap_begin can't be tied to the
+ * buffer that ends up delayed, and rewriting a delayed block would reserve it again.
+ */
+static ssize_t dwarfs_buffered_write_iter(struct kiocb *iocb, struct iov_iter *iter) {
+  struct file *file = iocb->ki_filp;
+  struct inode *inode = file_inode(file);
+  ssize_t ret;
+
+  inode_lock(inode);
+  ret = generic_write_checks(iocb, iter);
+  if(ret <= 0)
+    goto out;
+  if((ret = file_remove_privs(file)) || (ret = file_update_time(file)))
+    goto out;
+  if(dwarfs_has_inline_data(inode) && iocb->ki_pos + iov_iter_count(iter) > DWARFS_INLINE_MAX &&
+     (ret = dwarfs_inline_convert(inode)))
+    goto out;
+  current->backing_dev_info = inode_to_bdi(inode);
+  if(dwarfs_has_inline_data(inode))
+    ret = generic_perform_write(file, iter, iocb->ki_pos);
+  else
+    ret = iomap_file_buffered_write(iocb, iter, &dwarfs_iomap_ops);
+  current->backing_dev_info = NULL;
+  if(ret > 0)
+    iocb->ki_pos += ret;
+out:
+  inode_unlock(inode);
+  if(ret > 0)
+    ret = generic_write_sync(iocb, ret);
+  return ret;
+}
+
 ssize_t dwarfs_file_write_iter(struct kiocb *iocb, struct iov_iter *iter) {
-  return generic_file_write_iter(iocb, iter);
+  if(dwarfs_has_inline_data(file_inode(iocb->ki_filp)))
+    iocb->ki_flags &= ~IOCB_DIRECT;
+  if(iocb->ki_flags & IOCB_DIRECT)
+    return dwarfs_dio_write_iter(iocb, iter);
+  if(dwarfs_test_opt(file_inode(iocb->ki_filp)->i_sb, DWARFS_MOUNT_DELALLOC))
+    return generic_file_write_iter(iocb, iter);
+  return dwarfs_buffered_write_iter(iocb, iter);
 }
 
+/*
+ * SEEK_HOLE and SEEK_DATA walk the block map. Delayed blocks aren't mapped yet and
+ * would look like holes, so with delalloc the file is written back first.
+ */
 loff_t dwarfs_file_llseek(struct file *file, loff_t offset, int whence) {
-  return generic_file_llseek(file, offset, whence);
+  struct inode *inode = file_inode(file);
+  int err;
+
+  if(whence != SEEK_HOLE && whence != SEEK_DATA)
+    return generic_file_llseek(file, offset, whence);
+
+  if(dwarfs_test_opt(inode->i_sb, DWARFS_MOUNT_DELALLOC) && (err = filemap_write_and_wait(inode->i_mapping)))
+    return err;
+  inode_lock_shared(inode);
+  if(whence == SEEK_HOLE)
+    offset = iomap_seek_hole(inode, offset, &dwarfs_iomap_ops);
+  else
+    offset = iomap_seek_data(inode, offset, &dwarfs_iomap_ops);
+  inode_unlock_shared(inode);
+  if(offset < 0)
+    return offset;
+  return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/* Give up the reservation window when a writer closes the file */
+int dwarfs_file_release(struct inode *inode, struct file *file) {
+  if(file->f_mode & FMODE_WRITE)
+    dwarfs_discard_window(inode);
+  return 0;
+}
+
+/*
+ * Zero the bytes [start, end) of a single block through the page cache, so partially
+ * punched blocks keep their data around the hole.
+ */
+static int dwarfs_zero_partial_block(struct inode *inode, loff_t start, loff_t end) {
+  struct page *page;
+
+  if(start >= end || start >= i_size_read(inode))
+    return 0;
+  page = read_mapping_page(inode->i_mapping, start >> PAGE_SHIFT, NULL);
+  if(IS_ERR(page))
+    return PTR_ERR(page);
+  lock_page(page);
+  zero_user(page, start & ~PAGE_MASK, end - start);
+  set_page_dirty(page);
+  unlock_page(page);
+  put_page(page);
+  return 0;
+}
+
+/*
+ * Punch a hole into [offset, offset + len). Whole blocks inside the range are freed,
+ * the partial blocks at its edges are zeroed.
+ */
+static int dwarfs_punch_hole(struct inode *inode, loff_t offset, loff_t len) {
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t end = offset + len;
+  loff_t first = round_up(offset, 1 << blkbits);
+  loff_t last = round_down(end, 1 << blkbits);
+  int err;
+
+  // Settle delayed allocations and direct I/O first, so none of them lands in the hole later on
+  inode_dio_wait(inode);
+  if((err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1)))
+    return err;
+
+  if(first > last) // The hole is inside a single block
+    return dwarfs_zero_partial_block(inode, offset, end);
+  if((err = dwarfs_zero_partial_block(inode, offset, first)))
+    return err;
+  if((err = dwarfs_zero_partial_block(inode, last, end)))
+    return err;
+  if(first == last)
+    return 0;
+
+  truncate_pagecache_range(inode, first, last - 1);
+  return dwarfs_free_range(inode, first >> blkbits, last >> blkbits);
+}
+
+/*
+ * Preallocation hands out unwritten blocks without zeroing them, holes are punched by
+ * giving the blocks back to the bitmap.
+ */
+long dwarfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+  struct inode *inode = file_inode(file);
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t end = offset + len;
+  int err;
+
+  if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    return -EOPNOTSUPP;
+  if(!S_ISREG(inode->i_mode))
+    return -ENODEV;
+
+  inode_lock(inode);
+  if(mode & FALLOC_FL_PUNCH_HOLE) {
+    err = dwarfs_punch_hole(inode, offset, len);
+    goto out;
+  }
+
+  if(!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+    if((err = inode_newsize_ok(inode, end)))
+      goto out;
+  }
+  if((err = dwarfs_inline_convert(inode)))
+    goto out;
+  err = dwarfs_prealloc_range(inode, offset >> blkbits, (end + (1 << blkbits) - 1) >> blkbits);
+  if(!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+    i_size_write(inode, end);
+
+out:
+  if(!err) {
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+    mark_inode_dirty(inode);
+  }
+  inode_unlock(inode);
+  return err;
+}
+
+/* FITRIM discards the free blocks of the whole filesystem in one go */
+static int dwarfs_ioctl_fitrim(struct super_block *sb, void __user *arg) {
+  struct request_queue *q = bdev_get_queue(sb->s_bdev);
+  struct fstrim_range range;
+  int err;
+
+  if(!capable(CAP_SYS_ADMIN))
+    return -EPERM;
+  if(!blk_queue_discard(q))
+    return -EOPNOTSUPP;
+  if(copy_from_user(&range, arg, sizeof(range)))
+    return -EFAULT;
+
+  range.minlen = max_t(uint64_t, range.minlen, q->limits.discard_granularity);
+  if((err = dwarfs_trim_fs(sb, &range)))
+    return err;
+  if(copy_to_user(arg, &range, sizeof(range)))
+    return -EFAULT;
+  return 0;
+}
+
+long dwarfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+  switch(cmd) {
+  case FITRIM:
+    return dwarfs_ioctl_fitrim(file_inode(file)->i_sb, (void __user *)arg);
+  default:
+    return -ENOTTY;
+  }
 }
 
 int dwarfs_fsync(struct file *file, loff_t start, loff_t end, int sync) {
   return generic_file_fsync(file, start, end, sync);
 }
 
+/*
+ * Same as generic_file_vm_ops, plus page_mkwrite to allocate or reserve the blocks of a
+ * page when a shared mapping first writes to it. This kernel has no large folios, and only
+ * collapses executable file mappings into huge pages, so data mappings stay in small pages.
+ */
+static const struct vm_operations_struct dwarfs_file_vm_ops = {
+  .fault          = filemap_fault,
+  .map_pages      = filemap_map_pages,
+  .page_mkwrite   = dwarfs_page_mkwrite,
+};
+
+static int dwarfs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+  file_accessed(file);
+  vma->vm_ops = &dwarfs_file_vm_ops;
+  return 0;
+}
+
 const struct file_operations dwarfs_file_operations = {
     .llseek             = dwarfs_file_llseek,
     .read_iter          = dwarfs_file_read_iter,
     .write_iter         = dwarfs_file_write_iter,
-  //  .release          = generic_release,
+    .release            = dwarfs_file_release,
     .fsync              = dwarfs_fsync,
-    .mmap               = generic_file_mmap,
+    .fallocate          = dwarfs_fallocate,
+    .unlocked_ioctl     = dwarfs_ioctl,
+    .mmap               = dwarfs_file_mmap,
     .splice_read        = generic_file_splice_read,
     .splice_write       = iter_file_splice_write,
     .open               = dquot_file_open,
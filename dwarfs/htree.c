@@ -0,0 +1,617 @@
+#include <linux/buffer_head.h>
+#include <linux/compat.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+
+#include "dwarfs.h"
+
+/*
+ * Hash indexed directories, for directories with FS_INDEX_FL set.
+ * Block 0 keeps DOT and DOTDOT, the rest of it is the index root: a header followed by
+ * entries sorted by hash, each naming the block that holds the names hashing to at least
+ * its own hash and below the next entry's. The first entry covers everything below the
+ * second one. Leaves are ordinary directory blocks, in no particular order.
+ * Directories with variable length entries get a second level once the root is full: the
+ * root then points to index nodes, which point to the leaves. An index node starts with an
+ * unused entry covering the whole block, so readdir sees an empty block.
+ * A lookup reads block 0, at most one index node and a single leaf, however big the
+ * directory is.
+ * Directories start out linear and get an index once their first block is full.
+ * A hash is never split across leaves, so a leaf full of names with one hash can't take
+ * another one. With 32 bit hashes that takes some effort to run into.
+ * Splits move names between blocks, so readdir of an indexed directory goes in hash order
+ * and hands out cookies made of the hash and a second one, not offsets in the directory.
+ * The index is protected by the directory's i_rwsem.
+ */
+
+/* Pairs of hash and entry, for sorting the names of a leaf that is split */
+struct dwarfs_dx_map {
+    uint32_t hash;
+    struct dwarfs_directory_entry *entry;
+};
+
+/* A name of a leaf and its readdir cookie */
+struct dwarfs_dx_cookie {
+    loff_t cookie;
+    struct dwarfs_directory_entry *entry;
+};
+
+/* One level of a lookup: the root or an index node, and the entry the hash falls under */
+struct dwarfs_dx_frame {
+    struct buffer_head *bh;
+    struct dwarfs_dx_root *node;
+    int pos;
+};
+
+#define DWARFS_DX_MAX_LEVELS 1
+#define DWARFS_DX_FIRST(root) ((struct dwarfs_dx_entry *)((root) + 1))
+
+/* FNV-1a, starting from basis */
+static uint32_t dwarfs_dx_fnv(const char *name, int namelen, uint32_t basis) {
+    uint32_t hash = basis;
+
+    while(namelen--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* This is stored on disk, so it can't depend on the kernel or the architecture */
+static uint32_t dwarfs_dx_hash(const char *name, int namelen) {
+    return dwarfs_dx_fnv(name, namelen, 2166136261U);
+}
+
+/*
+ * Readdir position of a name: its hash in the upper bits, a second hash to tell names
+ * with the same hash apart below it. 0 and 1 are DOT and DOTDOT.
+ * Callers that keep 32 bit positions, compat getdents and NFS, only get the upper 30 bits
+ * of the hash. Names that share them share their position.
+ */
+static inline loff_t dwarfs_dx_hash_pos(uint32_t hash, bool is32) {
+    if(is32)
+        return (hash >> 2) + 2;
+    return ((loff_t)hash << 30) + 2;
+}
+
+static inline loff_t dwarfs_dx_cookie(uint32_t hash, const char *name, int namelen, bool is32) {
+    if(is32)
+        return dwarfs_dx_hash_pos(hash, true);
+    return dwarfs_dx_hash_pos(hash, false) + (dwarfs_dx_fnv(name, namelen, 0x9E3779B9U) >> 2);
+}
+
+static inline uint32_t dwarfs_dx_cookie_hash(loff_t cookie, bool is32) {
+    if(cookie < 2)
+        return 0;
+    return is32 ? (cookie - 2) << 2 : (cookie - 2) >> 30;
+}
+
+static bool dwarfs_dx_32bit(struct file *file) {
+    if(file->f_mode & FMODE_32BITHASH)
+        return true;
+    if(file->f_mode & FMODE_64BITHASH)
+        return false;
+#ifdef CONFIG_COMPAT
+    return in_compat_syscall();
+#else
+    return BITS_PER_LONG == 32;
+#endif
+}
+
+/* Readdir position after the last name of an indexed directory */
+loff_t dwarfs_dx_eof(struct file *file) {
+    return dwarfs_dx_32bit(file) ? DWARFS_DX_EOF_32BIT : DWARFS_DX_EOF;
+}
+
+/* The root follows the space DOT and DOTDOT need, which DOTDOT covers in variable length directories */
+static inline unsigned int dwarfs_dx_root_offset(struct inode *dir) {
+    return dwarfs_dir_rec_len(dir, 1) + dwarfs_dir_rec_len(dir, 2);
+}
+
+/* Index nodes follow the unused entry that hides them */
+static inline unsigned int dwarfs_dx_node_offset(struct inode *dir) {
+    return dwarfs_dir_rec_len(dir, 0);
+}
+
+static inline struct dwarfs_dx_root *dwarfs_dx_root(struct inode *dir, struct buffer_head *bh) {
+    return (struct dwarfs_dx_root *)(bh->b_data + dwarfs_dx_root_offset(dir));
+}
+
+static inline struct dwarfs_dx_root *dwarfs_dx_node(struct inode *dir, struct buffer_head *bh) {
+    return (struct dwarfs_dx_root *)(bh->b_data + dwarfs_dx_node_offset(dir));
+}
+
+/* Entries that fit in a block after a header at offset */
+static inline uint16_t dwarfs_dx_limit(struct inode *dir, unsigned int offset) {
+    return (dir->i_sb->s_blocksize - offset - sizeof(struct dwarfs_dx_root)) / sizeof(struct dwarfs_dx_entry);
+}
+
+static inline bool dwarfs_dx_bad_node(struct dwarfs_dx_root *node, uint16_t limit) {
+    return le16_to_cpu(node->dx_magic) != DWARFS_DX_MAGIC || le16_to_cpu(node->dx_limit) != limit ||
+           !node->dx_count || le16_to_cpu(node->dx_count) > limit;
+}
+
+/* Mark an index or leaf block the caller still holds dirty */
+static inline void dwarfs_dx_dirty(struct super_block *sb, struct buffer_head *bh) {
+    mark_buffer_dirty(bh);
+    if(sb->s_flags & SB_SYNCHRONOUS)
+        sync_dirty_buffer(bh);
+}
+
+/* Read and check the index root of dir. The caller must release *bhp */
+static struct dwarfs_dx_root *dwarfs_dx_get_root(struct inode *dir, struct buffer_head **bhp) {
+    struct buffer_head *bh = dwarfs_dir_bread(dir, 0);
+    struct dwarfs_dx_root *root;
+
+    if(IS_ERR(bh))
+        return ERR_CAST(bh);
+    root = dwarfs_dx_root(dir, bh);
+    if(dwarfs_dx_bad_node(root, dwarfs_dx_limit(dir, dwarfs_dx_root_offset(dir))) ||
+       le16_to_cpu(root->dx_levels) > (dwarfs_dir_varlen(dir) ? DWARFS_DX_MAX_LEVELS : 0)) {
+        printk("Dwarfs: corrupt index in directory %lu\n", dir->i_ino);
+        brelse(bh);
+        return ERR_PTR(-EFSCORRUPTED);
+    }
+    *bhp = bh;
+    return root;
+}
+
+/* Binary search for the index entry covering hash */
+static int dwarfs_dx_search(struct dwarfs_dx_root *root, uint32_t hash) {
+    struct dwarfs_dx_entry *entries = DWARFS_DX_FIRST(root);
+    int lo = 1, hi = le16_to_cpu(root->dx_count) - 1;
+    int mid, found = 0;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(le32_to_cpu(entries[mid].dx_hash) <= hash) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+/* Block the entry a frame points at names, which must lie inside the directory and not be the root */
+static struct buffer_head *dwarfs_dx_get_block(struct inode *dir, struct dwarfs_dx_frame *frame, sector_t *block) {
+    *block = le32_to_cpu(DWARFS_DX_FIRST(frame->node)[frame->pos].dx_block);
+    if(!*block) {
+        printk("Dwarfs: index of directory %lu points at its root\n", dir->i_ino);
+        return ERR_PTR(-EFSCORRUPTED);
+    }
+    return dwarfs_dir_bread(dir, *block);
+}
+
+static void dwarfs_dx_release(struct dwarfs_dx_frame *frames, int levels) {
+    int i;
+
+    for(i = 0; i <= levels; i++)
+        brelse(frames[i].bh);
+}
+
+/*
+ * Walk the index of dir down to the entry covering hash, one frame per level. Returns the
+ * number of levels below the root, the caller must release the frames with dwarfs_dx_release.
+ */
+static int dwarfs_dx_probe(struct inode *dir, uint32_t hash, struct dwarfs_dx_frame *frames) {
+    struct dwarfs_dx_root *root, *node;
+    struct buffer_head *bh;
+    sector_t block;
+    int levels;
+
+    root = dwarfs_dx_get_root(dir, &bh);
+    if(IS_ERR(root))
+        return PTR_ERR(root);
+    frames[0].bh = bh;
+    frames[0].node = root;
+    frames[0].pos = dwarfs_dx_search(root, hash);
+    if(!(levels = le16_to_cpu(root->dx_levels)))
+        return 0;
+
+    bh = dwarfs_dx_get_block(dir, &frames[0], &block);
+    if(IS_ERR(bh)) {
+        brelse(frames[0].bh);
+        return PTR_ERR(bh);
+    }
+    node = dwarfs_dx_node(dir, bh);
+    if(dwarfs_dx_bad_node(node, dwarfs_dx_limit(dir, dwarfs_dx_node_offset(dir))) || node->dx_levels) {
+        printk("Dwarfs: corrupt index node %llu in directory %lu\n", (unsigned long long)block, dir->i_ino);
+        brelse(bh);
+        brelse(frames[0].bh);
+        return -EFSCORRUPTED;
+    }
+    frames[1].bh = bh;
+    frames[1].node = node;
+    frames[1].pos = dwarfs_dx_search(node, hash);
+    return levels;
+}
+
+/*
+ * Look up name in the indexed directory dir. Returns the entry and its block in *bhp,
+ * which the caller must release, or NULL if there is no such name.
+ */
+struct dwarfs_directory_entry *dwarfs_dx_find(struct inode *dir, const char *name, int namelen, struct buffer_head **bhp) {
+    struct dwarfs_dx_frame frames[DWARFS_DX_MAX_LEVELS + 1];
+    struct dwarfs_directory_entry *direntry;
+    struct buffer_head *bh;
+    sector_t leaf;
+    int levels;
+
+    if((levels = dwarfs_dx_probe(dir, dwarfs_dx_hash(name, namelen), frames)) < 0)
+        return ERR_PTR(levels);
+    bh = dwarfs_dx_get_block(dir, &frames[levels], &leaf);
+    dwarfs_dx_release(frames, levels);
+    if(IS_ERR(bh))
+        return ERR_CAST(bh);
+    if((direntry = dwarfs_dir_find_in_block(dir, bh, leaf, name, namelen))) {
+        *bhp = bh;
+        return direntry;
+    }
+    brelse(bh);
+    return NULL;
+}
+
+static int dwarfs_dx_cookie_cmp(const void *a, const void *b) {
+    const struct dwarfs_dx_cookie *x = a, *y = b;
+
+    if(x->cookie != y->cookie)
+        return x->cookie < y->cookie ? -1 : 1;
+    return 0;
+}
+
+static int dwarfs_dx_map_cmp(const void *a, const void *b) {
+    const struct dwarfs_dx_map *x = a, *y = b;
+
+    if(x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Collect the entries of block, which is block lblk of dir, with their hashes, starting
+ * after from, or at the start if from is NULL. Returns how many there are.
+ */
+static int dwarfs_dx_collect(struct inode *dir, void *block, sector_t lblk, struct dwarfs_directory_entry *from, struct dwarfs_dx_map *map) {
+    struct dwarfs_directory_entry *direntry = from ? dwarfs_dir_next(dir, block, lblk, from) : block;
+    int count = 0;
+
+    for( ; direntry; direntry = dwarfs_dir_next(dir, block, lblk, direntry)) {
+        if(!direntry->inode)
+            continue;
+        map[count].hash = dwarfs_dx_hash(direntry->filename, direntry->namelen);
+        map[count].entry = direntry;
+        count++;
+    }
+    return count;
+}
+
+/* Most entries a block can hold */
+static inline int dwarfs_dx_max_entries(struct inode *dir) {
+    return dir->i_sb->s_blocksize / dwarfs_dir_rec_len(dir, 1);
+}
+
+/* Insert an entry for block, starting at hash, after entry pos of node, which has room for it */
+static void dwarfs_dx_insert(struct dwarfs_dx_root *node, int pos, uint32_t hash, sector_t block) {
+    struct dwarfs_dx_entry *entries = DWARFS_DX_FIRST(node);
+    int count = le16_to_cpu(node->dx_count);
+
+    memmove(&entries[pos + 2], &entries[pos + 1], (count - pos - 1) * sizeof(struct dwarfs_dx_entry));
+    entries[pos + 1].dx_hash = cpu_to_le32(hash);
+    entries[pos + 1].dx_block = cpu_to_le32(block);
+    node->dx_count = cpu_to_le16(count + 1);
+}
+
+/* Add an index node to dir, holding count entries. The caller must release *bhp */
+static struct dwarfs_dx_root *dwarfs_dx_new_node(struct inode *dir, struct dwarfs_dx_entry *entries, int count, sector_t *block, struct buffer_head **bhp) {
+    struct buffer_head *bh = dwarfs_dir_append_block(dir, block);
+    struct dwarfs_dx_root *node;
+
+    if(IS_ERR(bh))
+        return ERR_CAST(bh);
+    node = dwarfs_dx_node(dir, bh);
+    node->dx_magic = cpu_to_le16(DWARFS_DX_MAGIC);
+    node->dx_count = cpu_to_le16(count);
+    node->dx_limit = cpu_to_le16(dwarfs_dx_limit(dir, dwarfs_dx_node_offset(dir)));
+    node->dx_levels = 0;
+    memcpy(DWARFS_DX_FIRST(node), entries, count * sizeof(struct dwarfs_dx_entry));
+    *bhp = bh;
+    return node;
+}
+
+/*
+ * Make room for one more entry in the lowest index node of a lookup. A full root moves
+ * its entries to an index node below it, a full index node gives half of its entries to
+ * a new one. Returns 1 if the index changed and has to be walked again, 0 if there
+ * already was room.
+ */
+static int dwarfs_dx_make_room(struct inode *dir, struct dwarfs_dx_frame *frames, int levels) {
+    struct super_block *sb = dir->i_sb;
+    struct dwarfs_dx_root *root = frames[0].node;
+    struct dwarfs_dx_root *full = frames[levels].node;
+    struct dwarfs_dx_root *node;
+    struct buffer_head *bh;
+    int count = le16_to_cpu(full->dx_count);
+    sector_t block;
+
+    if(count < le16_to_cpu(full->dx_limit))
+        return 0;
+    if(!dwarfs_dir_varlen(dir) || (levels && le16_to_cpu(root->dx_count) >= le16_to_cpu(root->dx_limit))) {
+        printk("Dwarfs: index of directory %lu is full\n", dir->i_ino);
+        return -ENOSPC;
+    }
+
+    if(!levels) {
+        node = dwarfs_dx_new_node(dir, DWARFS_DX_FIRST(root), count, &block, &bh);
+        if(IS_ERR(node))
+            return PTR_ERR(node);
+        root->dx_count = cpu_to_le16(1);
+        root->dx_levels = cpu_to_le16(1);
+        DWARFS_DX_FIRST(root)[0].dx_hash = 0;
+        DWARFS_DX_FIRST(root)[0].dx_block = cpu_to_le32(block);
+    } else {
+        node = dwarfs_dx_new_node(dir, DWARFS_DX_FIRST(full) + count / 2, count - count / 2, &block, &bh);
+        if(IS_ERR(node))
+            return PTR_ERR(node);
+        full->dx_count = cpu_to_le16(count / 2);
+        dwarfs_dx_insert(root, frames[0].pos, le32_to_cpu(DWARFS_DX_FIRST(node)[0].dx_hash), block);
+        dwarfs_dx_dirty(sb, frames[1].bh);
+    }
+    dwarfs_write_buffer(&bh, sb);
+    dwarfs_dx_dirty(sb, frames[0].bh);
+    return 1;
+}
+
+/*
+ * Move the upper half of the full leaf bh, by hash, to a new block and index it after the
+ * entry of frame, whose node must have room for it.
+ */
+static int dwarfs_dx_split(struct inode *dir, struct dwarfs_dx_frame *frame, struct buffer_head *bh, sector_t leaf) {
+    struct super_block *sb = dir->i_sb;
+    struct dwarfs_directory_entry **sorted = NULL;
+    struct dwarfs_dx_map *map = NULL;
+    struct buffer_head *newbh;
+    void *copy = NULL;
+    sector_t newleaf;
+    int i, n, split, err = 0;
+
+    copy = kmalloc(sb->s_blocksize, GFP_NOFS);
+    map = kmalloc_array(dwarfs_dx_max_entries(dir), sizeof(struct dwarfs_dx_map), GFP_NOFS);
+    sorted = kmalloc_array(dwarfs_dx_max_entries(dir), sizeof(struct dwarfs_directory_entry *), GFP_NOFS);
+    if(!copy || !map || !sorted) {
+        err = -ENOMEM;
+        goto out;
+    }
+    memcpy(copy, bh->b_data, sb->s_blocksize);
+    n = dwarfs_dx_collect(dir, copy, leaf, NULL, map);
+    sort(map, n, sizeof(struct dwarfs_dx_map), dwarfs_dx_map_cmp, NULL);
+    for(i = 0; i < n; i++)
+        sorted[i] = map[i].entry;
+
+    /* Split in the middle, moved to the nearest change of hash */
+    for(split = n / 2; split && split < n && map[split].hash == map[split - 1].hash; split++);
+    if(split == n)
+        for(split = n / 2; split > 0 && map[split].hash == map[split - 1].hash; split--);
+    if(!split) {
+        printk("Dwarfs: too many names with the same hash in directory %lu\n", dir->i_ino);
+        err = -ENOSPC;
+        goto out;
+    }
+
+    newbh = dwarfs_dir_append_block(dir, &newleaf);
+    if(IS_ERR(newbh)) {
+        err = PTR_ERR(newbh);
+        goto out;
+    }
+    dwarfs_dir_pack(dir, bh->b_data, sorted, split);
+    dwarfs_dir_pack(dir, newbh->b_data, sorted + split, n - split);
+    dwarfs_dx_insert(frame->node, frame->pos, map[split].hash, newleaf);
+    dwarfs_write_buffer(&newbh, sb);
+    dwarfs_dx_dirty(sb, bh);
+    dwarfs_dx_dirty(sb, frame->bh);
+out:
+    kfree(sorted);
+    kfree(map);
+    kfree(copy);
+    return err;
+}
+
+/*
+ * Add name to the indexed directory dir. Only the leaf name hashes to can hold it, so
+ * that is the only one checked for a duplicate. Until the leaf has room it is split,
+ * growing the index first if it has no room for another leaf, and the index is walked
+ * again. With variable length entries one split may not be enough.
+ */
+int dwarfs_dx_add_entry(struct inode *dir, const char *name, int namelen, uint64_t ino, umode_t mode) {
+    struct dwarfs_dx_frame frames[DWARFS_DX_MAX_LEVELS + 1];
+    uint32_t hash = dwarfs_dx_hash(name, namelen);
+    struct dwarfs_directory_entry *direntry;
+    struct buffer_head *bh;
+    sector_t leaf;
+    int levels, err;
+
+    for(;;) {
+        if((levels = dwarfs_dx_probe(dir, hash, frames)) < 0)
+            return levels;
+        bh = dwarfs_dx_get_block(dir, &frames[levels], &leaf);
+        if(IS_ERR(bh)) {
+            dwarfs_dx_release(frames, levels);
+            return PTR_ERR(bh);
+        }
+        if(dwarfs_dir_find_in_block(dir, bh, leaf, name, namelen)) {
+            printk("Dwarfs: file %.*s already exists!\n", namelen, name);
+            err = -EEXISTS;
+            break;
+        }
+        if((direntry = dwarfs_dir_add_slot(dir, bh, leaf, namelen))) {
+            dwarfs_set_direntry(dir, direntry, name, namelen, ino, mode);
+            dwarfs_dx_dirty(dir->i_sb, bh);
+            err = 0;
+            break;
+        }
+        if((err = dwarfs_dx_make_room(dir, frames, levels)) < 0)
+            break;
+        if(!err && (err = dwarfs_dx_split(dir, &frames[levels], bh, leaf)))
+            break;
+        brelse(bh);
+        dwarfs_dx_release(frames, levels);
+    }
+    brelse(bh);
+    dwarfs_dx_release(frames, levels);
+    return err;
+}
+
+/*
+ * Index the linear directory dir, whose only block is full. The names move to a new
+ * leaf and the index root takes their place. Directories that don't start with DOT and
+ * DOTDOT are left alone, the caller checks FS_INDEX_FL afterwards.
+ */
+int dwarfs_dx_convert(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct dwarfs_directory_entry *dot, *dotdot, **sorted = NULL;
+    struct dwarfs_dx_map *map = NULL;
+    struct dwarfs_dx_root *root;
+    struct buffer_head *bh, *newbh;
+    void *copy = NULL;
+    sector_t leaf;
+    int i, n, err = 0;
+
+    if(dwarfs_dir_blocks(dir) != 1)
+        return 0;
+    bh = dwarfs_dir_bread(dir, 0);
+    if(IS_ERR(bh))
+        return PTR_ERR(bh);
+    copy = kmalloc(sb->s_blocksize, GFP_NOFS);
+    map = kmalloc_array(dwarfs_dx_max_entries(dir), sizeof(struct dwarfs_dx_map), GFP_NOFS);
+    sorted = kmalloc_array(dwarfs_dx_max_entries(dir), sizeof(struct dwarfs_directory_entry *), GFP_NOFS);
+    if(!copy || !map || !sorted) {
+        err = -ENOMEM;
+        goto out;
+    }
+    memcpy(copy, bh->b_data, sb->s_blocksize);
+    dot = copy;
+    dotdot = dwarfs_dir_next(dir, copy, 0, dot);
+    if(!dotdot || dot->namelen != 1 || dot->filename[0] != '.' || dotdot->namelen != 2 || memcmp(dotdot->filename, "..", 2))
+        goto out;
+
+    newbh = dwarfs_dir_append_block(dir, &leaf);
+    if(IS_ERR(newbh)) {
+        err = PTR_ERR(newbh);
+        goto out;
+    }
+    n = dwarfs_dx_collect(dir, copy, 0, dotdot, map);
+    for(i = 0; i < n; i++)
+        sorted[i] = map[i].entry;
+    dwarfs_dir_pack(dir, newbh->b_data, sorted, n);
+    dwarfs_write_buffer(&newbh, sb);
+
+    sorted[0] = dot;
+    sorted[1] = dotdot;
+    dwarfs_dir_pack(dir, bh->b_data, sorted, 2);
+    root = dwarfs_dx_root(dir, bh);
+    root->dx_magic = cpu_to_le16(DWARFS_DX_MAGIC);
+    root->dx_count = cpu_to_le16(1);
+    root->dx_limit = cpu_to_le16(dwarfs_dx_limit(dir, dwarfs_dx_root_offset(dir)));
+    root->dx_levels = 0;
+    DWARFS_DX_FIRST(root)[0].dx_hash = 0;
+    DWARFS_DX_FIRST(root)[0].dx_block = cpu_to_le32(leaf);
+    dwarfs_dx_dirty(sb, bh);
+
+    DWARFS_INODE(dir)->inode_flags |= FS_INDEX_FL;
+    mark_inode_dirty(dir);
+out:
+    brelse(bh);
+    kfree(sorted);
+    kfree(map);
+    kfree(copy);
+    return err;
+}
+
+/*
+ * Hash of the leaf after the one the frames point at, in index order. Returns false after
+ * the last leaf.
+ */
+static bool dwarfs_dx_next_hash(struct dwarfs_dx_frame *frames, int levels, uint32_t *hash) {
+    int i;
+
+    for(i = levels; i >= 0; i--) {
+        if(frames[i].pos + 1 < le16_to_cpu(frames[i].node->dx_count)) {
+            *hash = le32_to_cpu(DWARFS_DX_FIRST(frames[i].node)[frames[i].pos + 1].dx_hash);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * readdir of the indexed directory dir, a leaf at a time in hash order. The names of a
+ * leaf are sorted by cookie, and those before ctx->pos were returned already.
+ * Leaves are found by hash, ctx->pos only picks the first one. A 32 bit position may point
+ * into the leaf before the one it came from, its names before the position are skipped.
+ */
+int dwarfs_dx_readdir(struct file *file, struct dir_context *ctx) {
+    struct inode *dir = file_inode(file);
+    struct dwarfs_dx_frame frames[DWARFS_DX_MAX_LEVELS + 1];
+    struct dwarfs_dx_cookie *names;
+    struct dwarfs_directory_entry *direntry;
+    struct buffer_head *bh;
+    bool is32 = dwarfs_dx_32bit(file);
+    sector_t leaf;
+    uint32_t hash, next;
+    bool more;
+    int i, n, levels, err = 0;
+
+    if(!dir_emit_dots(file, ctx))
+        return 0;
+    if(ctx->pos >= dwarfs_dx_eof(file))
+        return 0;
+    if(!(names = kmalloc_array(dwarfs_dx_max_entries(dir), sizeof(struct dwarfs_dx_cookie), GFP_NOFS)))
+        return -ENOMEM;
+
+    hash = dwarfs_dx_cookie_hash(ctx->pos, is32);
+    for(;;) {
+        if((levels = dwarfs_dx_probe(dir, hash, frames)) < 0) {
+            err = levels;
+            break;
+        }
+        bh = dwarfs_dx_get_block(dir, &frames[levels], &leaf);
+        more = dwarfs_dx_next_hash(frames, levels, &next);
+        dwarfs_dx_release(frames, levels);
+        if(IS_ERR(bh)) {
+            err = PTR_ERR(bh);
+            break;
+        }
+
+        n = 0;
+        direntry = (struct dwarfs_directory_entry *)bh->b_data;
+        for( ; direntry; direntry = dwarfs_dir_next(dir, bh->b_data, leaf, direntry)) {
+            if(!direntry->inode)
+                continue;
+            names[n].cookie = dwarfs_dx_cookie(dwarfs_dx_hash(direntry->filename, direntry->namelen), direntry->filename, direntry->namelen, is32);
+            names[n].entry = direntry;
+            if(names[n].cookie >= ctx->pos)
+                n++;
+        }
+        sort(names, n, sizeof(struct dwarfs_dx_cookie), dwarfs_dx_cookie_cmp, NULL);
+        for(i = 0; i < n; i++) {
+            direntry = names[i].entry;
+            ctx->pos = names[i].cookie;
+            if(!dir_emit(ctx, direntry->filename, direntry->namelen, le64_to_cpu(direntry->inode), fs_ftype_to_dtype(direntry->filetype)))
+                break;
+            ctx->pos = names[i].cookie + 1;
+        }
+        brelse(bh);
+        if(i < n)
+            break;
+        if(!more) {
+            ctx->pos = dwarfs_dx_eof(file);
+            break;
+        }
+        hash = next;
+        ctx->pos = dwarfs_dx_hash_pos(hash, is32);
+    }
+    kfree(names);
+    return err;
+}
@@ -0,0 +1,100 @@
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/string.h>
+
+#include "dwarfs.h"
+
+/*
+ * Regular files with FS_INLINE_DATA_FL set keep their contents in inode_blocks instead of
+ * data blocks, which saves a block and a second read for tiny files. New files start out
+ * inline. Page 0 of such a file has no buffers: it's filled from the inode when read, and
+ * copied back into the inode when written. A write that would take the file past
+ * DWARFS_INLINE_MAX moves it to an extent tree first.
+ */
+
+/* Fill a page of an inline file from the inode. The page must be locked */
+static void dwarfs_inline_fill_page(struct inode *inode, struct page *page) {
+    size_t size = page->index ? 0 : min_t(loff_t, i_size_read(inode), DWARFS_INLINE_MAX);
+    void *kaddr = kmap_atomic(page);
+
+    memcpy(kaddr, DWARFS_INODE(inode)->inode_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap_atomic(kaddr);
+    SetPageUptodate(page);
+}
+
+int dwarfs_inline_readpage(struct inode *inode, struct page *page) {
+    dwarfs_inline_fill_page(inode, page);
+    unlock_page(page);
+    return 0;
+}
+
+/* Copy page 0 back into the inode, after a write or when mmap dirtied it */
+static void dwarfs_inline_sync_page(struct inode *inode, struct page *page) {
+    size_t size = min_t(loff_t, i_size_read(inode), DWARFS_INLINE_MAX);
+    void *kaddr;
+
+    if(page->index)
+        return;
+    kaddr = kmap_atomic(page);
+    memcpy(DWARFS_INODE(inode)->inode_data, kaddr, size);
+    kunmap_atomic(kaddr);
+    mark_inode_dirty(inode);
+}
+
+int dwarfs_inline_writepage(struct page *page) {
+    dwarfs_inline_sync_page(page->mapping->host, page);
+    unlock_page(page);
+    return 0;
+}
+
+/* Buffered write to an inline file that stays within DWARFS_INLINE_MAX */
+int dwarfs_inline_write_begin(struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep) {
+    struct page *page = grab_cache_page_write_begin(mapping, 0, flags);
+
+    if(!page)
+        return -ENOMEM;
+    if(!PageUptodate(page))
+        dwarfs_inline_fill_page(mapping->host, page);
+    *pagep = page;
+    return 0;
+}
+
+int dwarfs_inline_write_end(struct inode *inode, loff_t pos, unsigned int copied, struct page *page) {
+    if(pos + copied > i_size_read(inode))
+        i_size_write(inode, pos + copied);
+    dwarfs_inline_sync_page(inode, page);
+    unlock_page(page);
+    put_page(page);
+    return copied;
+}
+
+/*
+ * Move the contents of an inline file out to a data block, and map it with extents from
+ * now on. The data stays in page 0, which is dirtied so writeback allocates its block.
+ * The inode must be locked.
+ */
+int dwarfs_inline_convert(struct inode *inode) {
+    struct page *page = NULL;
+
+    if(!dwarfs_has_inline_data(inode))
+        return 0;
+    if(!(page = grab_cache_page_write_begin(inode->i_mapping, 0, 0)))
+        return -ENOMEM;
+    if(!PageUptodate(page))
+        dwarfs_inline_fill_page(inode, page);
+
+    DWARFS_INODE(inode)->inode_flags &= ~FS_INLINE_DATA_FL;
+    DWARFS_INODE(inode)->inode_flags |= FS_EXTENT_FL;
+    dwarfs_ext_init(inode);
+    dwarfs_map_cache_invalidate(inode, 0, ~(sector_t)0, true);
+    mark_inode_dirty(inode);
+
+    if(i_size_read(inode))
+        set_page_dirty(page);
+    unlock_page(page);
+    put_page(page);
+    return 0;
+}
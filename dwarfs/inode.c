@@ -11,6 +11,7 @@
 #include <linux/quotaops.h>
 #include <linux/ktime.h>
 #include <linux/writeback.h>
+#include <linux/iomap.h>
 
 static int __dwarfs_iwrite(struct inode *inode, bool sync) {
     struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
@@ -38,6 +39,7 @@ static int __dwarfs_iwrite(struct inode *inode, bool sync) {
     dinode->inode_mtime = cpu_to_le64(inode->i_mtime.tv_sec);
     dinode->inode_dtime = dinode_i->inode_dtime;
     dinode->inode_flags = dinode_i->inode_flags;
+    dinode->inode_dir_start_lookup = cpu_to_le64(dinode_i->inode_dir_start_lookup);
 
     for(i = 0; i < DWARFS_NUMBLOCKS; i++) {
         dinode->inode_blocks[i] = dinode_i->inode_data[i];
@@ -74,10 +76,14 @@ void dwarfs_ievict(struct inode *inode) {
         __dwarfs_iwrite(inode, inode_needs_sync(inode));
 
         inode->i_size = 0;
-        if(inode->i_blocks || DWARFS_INODE(inode)->inode_data)
+        // Blocks are freed in the background. Without memory to queue the inode, free it here
+        if(dwarfs_orphan_add(inode)) {
             dwarfs_data_dealloc(inode->i_sb, inode);
+            dwarfs_inode_dealloc(inode->i_sb, inode->i_ino);
+        }
     }
 
+    dwarfs_discard_window(inode);
     invalidate_inode_buffers(inode);
     clear_inode(inode);
 
@@ -114,115 +120,92 @@ int dwarfs_sync_dinode(struct super_block *sb, struct inode *inode) {
     return 0;
 }
 
-int dwarfs_file_exists(struct inode *dir, const char *name) {
-    struct buffer_head *bh = NULL;
-    struct super_block *sb = dir->i_sb;
-    struct dwarfs_directory_entry *currentry = NULL;
-    int i;
-
-    for(i = 0; i < dir->i_blocks; i++) {
-        bh = sb_bread(sb, DWARFS_INODE(dir)->inode_data[i]);
-        currentry = (struct dwarfs_directory_entry *)bh->b_data;
-        for(; (char *)currentry <= bh->b_data + (sb->s_blocksize - sizeof(struct dwarfs_directory_entry)); currentry++) {
-            if(strncmp(currentry->filename, name, DWARFS_MAX_FILENAME_LEN) == 0) {
-                brelse(bh);
-                return 1;
-            }
-        }
-        brelse(bh);
-    }
-    return 0;
-}
-
+/*
+ * Add an entry for inode to the directory dentry lives in. Indexed directories add it to
+ * the leaf its name hashes to. Linear ones are scanned once, for a duplicate and for the
+ * first block with room, and get an index once their first block is full.
+ * inode_dir_start_lookup remembers the first block that may have room, so blocks known
+ * to be full aren't searched for free space again until something is deleted.
+ */
 int dwarfs_link_node(struct dentry *dentry, struct inode *inode) {
     struct inode *dirnode = d_inode(dentry->d_parent);
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(dirnode);
+    const char *name = dentry->d_name.name;
     int namelen = dentry->d_name.len;
-    struct buffer_head *bh = NULL;
+    struct buffer_head *bh = NULL, *slotbh = NULL;
     struct dwarfs_directory_entry *direntry = NULL;
-    char *address, *endaddress = NULL;
-    int i;
+    sector_t i, slot = 0;
+    int err = 0;
 
-    if(dwarfs_file_exists(dirnode, dentry->d_name.name)) {
-        printk("Dwarfs: file %s already exists!\n", dentry->d_name.name);
-        return -EEXISTS;
+    if(dwarfs_dir_indexed(dirnode)) {
+        err = dwarfs_dx_add_entry(dirnode, name, namelen, inode->i_ino, inode->i_mode);
+        goto out;
     }
-
-    for(i = 0; i < dirnode->i_blocks; i++) {
-        bh = sb_bread(dirnode->i_sb, DWARFS_INODE(dirnode)->inode_data[i]);
+    for(i = 0; i < dwarfs_dir_blocks(dirnode); i++) {
+        bh = dwarfs_dir_bread(dirnode, i);
         if(IS_ERR(bh)) {
-            printk("Dwarfs: couldn't get the node data buffer_head!\n");
-            return PTR_ERR(bh);
+            err = PTR_ERR(bh);
+            goto fail;
         }
-
-        address = (char*)bh->b_data;
-        endaddress = address + dirnode->i_sb->s_blocksize;
-        direntry = (struct dwarfs_directory_entry *)address;
-        while((char *)direntry <= endaddress-sizeof(struct dwarfs_directory_entry)) {
-            if(direntry->entrylen == 0 || direntry->entrylen > sizeof(struct dwarfs_directory_entry)) {
-                goto post_loop;
-            }
-            if(!direntry->inode || direntry->inode > DWARFS_SB(dirnode->i_sb)->dfsb->dwarfs_inodec) {
-                goto post_loop;
-            }
-            if(strnlen(direntry->filename, DWARFS_MAX_FILENAME_LEN) == 0) {
-                goto post_loop;
-            }
-            direntry++;
+        if(dwarfs_dir_find_in_block(dirnode, bh, i, name, namelen)) {
+            printk("Dwarfs: file %s already exists!\n", name);
+            brelse(bh);
+            err = -EEXISTS;
+            goto fail;
+        }
+        if(!slotbh && i >= dinode_i->inode_dir_start_lookup && dwarfs_dir_has_room(dirnode, bh, i, namelen)) {
+            slotbh = bh;
+            slot = i;
+            continue;
         }
         brelse(bh);
     }
-    if(dirnode->i_blocks < DWARFS_NUMBLOCKS) {
-        int64_t newblock;
-        newblock = dwarfs_data_alloc(dirnode->i_sb, dirnode);
-        DWARFS_INODE(dirnode)->inode_data[dirnode->i_blocks-1] = newblock;
-        dirnode->i_size += dirnode->i_sb->s_blocksize;
-        bh = sb_bread(dirnode->i_sb, newblock);
-        direntry = (struct dwarfs_directory_entry *)bh->b_data;
-        goto post_loop;
+    if(slotbh) {
+        bh = slotbh;
+        i = slot;
+        direntry = dwarfs_dir_add_slot(dirnode, bh, i, namelen);
+        goto found;
     }
-    else {
-        printk("Dwarfs: inode is full!\n");
-        return -ENOSPC;
+    if(dwarfs_dir_blocks(dirnode) == 1) { // The first block is full, index the directory from now on
+        if((err = dwarfs_dx_convert(dirnode)))
+            return err;
+        if(dwarfs_dir_indexed(dirnode)) {
+            err = dwarfs_dx_add_entry(dirnode, name, namelen, inode->i_ino, inode->i_mode);
+            goto out;
+        }
     }
+    bh = dwarfs_dir_append_block(dirnode, &i);
+    if(IS_ERR(bh))
+        return PTR_ERR(bh);
+    direntry = dwarfs_dir_add_slot(dirnode, bh, i, namelen);
 
-post_loop:
-    direntry->namelen = namelen;
-    strncpy(direntry->filename, dentry->d_name.name, DWARFS_MAX_FILENAME_LEN);
-    direntry->inode = cpu_to_le64(inode->i_ino);
-    direntry->filetype = 0;
-    direntry->entrylen = sizeof(struct dwarfs_directory_entry);
+found:
+    dinode_i->inode_dir_start_lookup = i;
+    dwarfs_set_direntry(dirnode, direntry, name, namelen, inode->i_ino, inode->i_mode);
     dwarfs_write_buffer(&bh, dirnode->i_sb);
+out:
+    if(err)
+        return err;
     dirnode->i_mtime = dirnode->i_ctime = current_time(dirnode);
-    DWARFS_INODE(dirnode)->inode_flags &= ~FS_BTREE_FL;
     mark_inode_dirty(dirnode);
     return 0;
+
+fail:
+    brelse(slotbh);
+    return err;
 }
 
 uint64_t dwarfs_get_ino_by_name(struct inode *dir, const struct qstr *inode_name) {
-    int64_t ino;
     struct dwarfs_directory_entry *dirent = NULL;
-    struct dwarfs_inode_info *di_i = NULL;
-    int i;
     struct buffer_head *bh = NULL;
+    uint64_t ino;
 
-    di_i = DWARFS_INODE(dir);
-    for(i = 0; i < dir->i_blocks; i++) {
-        if(di_i->inode_data[i] <= 0)
-            break;
-        
-        bh = sb_bread(dir->i_sb, di_i->inode_data[i]);
-        dirent = (struct dwarfs_directory_entry *)bh->b_data;
-        while(dirent && dirent < ((struct dwarfs_directory_entry *)bh->b_data + (dir->i_sb->s_blocksize/sizeof(struct dwarfs_directory_entry)))) {
-            if(dirent->filename && strnlen(dirent->filename, DWARFS_MAX_FILENAME_LEN) > 0) {
-                if(strncmp(dirent->filename, inode_name->name, DWARFS_MAX_FILENAME_LEN) == 0) {
-                    ino = dirent->inode;
-                    return ino;
-                }
-            }
-            dirent++;
-        }
-    }
-    return 0;
+    dirent = dwarfs_find_entry(dir, inode_name->name, inode_name->len, &bh);
+    if(IS_ERR_OR_NULL(dirent))
+        return 0;
+    ino = le64_to_cpu(dirent->inode);
+    brelse(bh);
+    return ino;
 }
 
 struct inode *dwarfs_create_inode(struct inode *dir, const struct qstr *namestr, umode_t mode) {
@@ -243,7 +226,12 @@ struct inode *dwarfs_create_inode(struct inode *dir, const struct qstr *namestr,
         return ERR_PTR(-ENOMEM);
     }
     dinode_i = DWARFS_INODE(newnode);
-    ino = dwarfs_inode_alloc(sb);
+    ino = dwarfs_inode_alloc(sb, dir, mode);
+    if(ino < 0) {
+        make_bad_inode(newnode);
+        iput(newnode);
+        return ERR_PTR(ino);
+    }
 
     inode_init_owner(newnode, dir, mode);
     newnode->i_mode = mode;
@@ -251,7 +239,9 @@ struct inode *dwarfs_create_inode(struct inode *dir, const struct qstr *namestr,
     newnode->i_blocks = 0;
     newnode->i_mtime = newnode->i_atime = newnode->i_ctime = current_time(newnode);
     memset(dinode_i->inode_data, 0, sizeof(dinode_i->inode_data));
-    dinode_i->inode_flags = 0; // This needs to be implemented still
+    dinode_i->inode_flags = 0;
+    if(S_ISREG(mode)) // New files start out inline, and move to extents once they outgrow the inode
+        dinode_i->inode_flags |= FS_INLINE_DATA_FL;
     dinode_i->inode_dtime = 0;
     dinode_i->inode_block_group = 0;
     dinode_i->inode_dir_start_lookup = 0;
@@ -366,10 +356,15 @@ struct inode *dwarfs_inode_get(struct super_block *sb, int64_t ino) {
 
     dinode_info->inode_dtime = 0;
     dinode_info->inode_state = 0;
-    dinode_info->inode_dir_start_lookup = 0;
+    // Images from before the hint have 0 there, which scans from the start
+    dinode_info->inode_dir_start_lookup = min_t(uint64_t, le64_to_cpu(dinode->inode_dir_start_lookup), dwarfs_dir_blocks(inode));
 
     for(i = 0; i < DWARFS_NUMBLOCKS; i++) {
-        dinode_info->inode_data[i] = (dinode->inode_blocks[i] < (dwarfs_datastart(sb) + DWARFS_SB(sb)->dfsb->dwarfs_blockc) ? dinode->inode_blocks[i] : 0);
+        if(dinode_info->inode_flags & (FS_EXTENT_FL | FS_INLINE_DATA_FL)) { // Extent roots are checked when the tree is walked, inline data isn't pointers
+            dinode_info->inode_data[i] = dinode->inode_blocks[i];
+            continue;
+        }
+        dinode_info->inode_data[i] = (dwarfs_blockptr_blockno(dinode->inode_blocks[i]) < (dwarfs_datastart(sb) + DWARFS_SB(sb)->dfsb->dwarfs_blockc) ? dinode->inode_blocks[i] : 0);
     }
 
     if(S_ISDIR(inode->i_mode)) {
@@ -398,124 +393,933 @@ struct inode *dwarfs_inode_get(struct super_block *sb, int64_t ino) {
     return inode;
 }
 
-__le64 dwarfs_get_indirect_blockno(struct inode *inode, sector_t offset, int create) {
+static inline bool dwarfs_valid_blockno(struct super_block *sb, __le64 blockno) {
+    blockno = dwarfs_blockptr_blockno(blockno);
+    return blockno && blockno < dwarfs_datastart(sb) + DWARFS_SB(sb)->dfsb->dwarfs_blockc;
+}
+
+/*
+ * Every inode caches the last run of blocks it looked up, so repeated and sequential
+ * lookups within a run don't walk the indirect list or the extent tree again, and the
+ * last indirect list block it reached, so walks further down the list don't start over.
+ * Changes to the mapping bump seq, lookups that raced with one aren't cached.
+ */
+static bool dwarfs_map_cache_lookup(struct inode *inode, sector_t iblock, unsigned long max, __le64 *blockno, unsigned long *len) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    struct dwarfs_map_cache *mc = &dinode_i->inode_map_cache;
+    bool hit = false;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    if(iblock >= mc->lblk && iblock - mc->lblk < mc->len) {
+        *blockno = mc->pblk ? mc->pblk + (iblock - mc->lblk) : 0;
+        *len = min_t(unsigned long, max, mc->len - (iblock - mc->lblk));
+        hit = true;
+    }
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+    return hit;
+}
+
+static unsigned long dwarfs_map_cache_seq(struct inode *inode) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    unsigned long seq;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    seq = dinode_i->inode_map_cache.seq;
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+    return seq;
+}
+
+static void dwarfs_map_cache_store(struct inode *inode, unsigned long seq, sector_t iblock, __le64 blockno, unsigned long len) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    struct dwarfs_map_cache *mc = &dinode_i->inode_map_cache;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    if(mc->seq == seq) {
+        mc->lblk = iblock;
+        mc->pblk = blockno;
+        mc->len = len;
+    }
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+}
+
+/*
+ * Called once the mapping of logical blocks [iblock, end) changed. The list cursor only
+ * goes away with drop_list, as list blocks are never freed while the inode is in use.
+ */
+void dwarfs_map_cache_invalidate(struct inode *inode, sector_t iblock, sector_t end, bool drop_list) {
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    struct dwarfs_map_cache *mc = &dinode_i->inode_map_cache;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    mc->seq++;
+    if(iblock < mc->lblk + mc->len && mc->lblk < end)
+        mc->len = 0;
+    if(drop_list)
+        mc->list_depth = 0;
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+}
+
+/*
+ * Find the slot holding the pointer to block offset of the indirect list.
+ * Missing levels of the list are allocated if create is set, otherwise NULL is returned.
+ * On success *bhp holds the list block containing the slot, which the caller must release.
+ */
+static __le64 *dwarfs_get_indirect_slot(struct inode *inode, sector_t offset, int create, struct buffer_head **bhp) {
     struct buffer_head *indirbh = NULL;
     struct super_block *sb = inode->i_sb;
-    struct dwarfs_superblock *dfsb = DWARFS_SB(sb)->dfsb;
-    int depth = 1;
-    int i;
-    bool created = false;
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    sector_t depth = 1;
+    sector_t i = 1;
+    int64_t newblock;
     __le64 *blocknums = NULL;
-    __le64 nextblock, ret;
+    __le64 nextblock = 0;
     unsigned nextptrloc = (sb->s_blocksize / sizeof(__le64)) - 1;
 
-    while(offset >= (DWARFS_BLOCK_SIZE / sizeof(int64_t)) - 1) { // These aren't the blocks you're looking for
-        depth++;
-        offset -= nextptrloc;
+    *bhp = NULL;
+    depth += offset / nextptrloc; // These aren't the blocks you're looking for
+    offset %= nextptrloc;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    if(dinode_i->inode_map_cache.list_depth && dinode_i->inode_map_cache.list_depth <= depth) { // Resume from the cursor
+        i = dinode_i->inode_map_cache.list_depth;
+        nextblock = dinode_i->inode_map_cache.list_block;
     }
+    spin_unlock(&dinode_i->inode_map_cache_lock);
 
-    nextblock = DWARFS_INODE(inode)->inode_data[DWARFS_INODE_INDIR];
-    if(!nextblock || nextblock > dwarfs_datastart(sb) + dfsb->dwarfs_blockc ) {
-        if(!create) {
-	    printk("Dwarfs: Block doesn't exist while create is FALSE\n");
-            return -EIO;
-	}
-        DWARFS_INODE(inode)->inode_data[DWARFS_INODE_INDIR] = dwarfs_data_alloc(sb, inode);
-        nextblock = DWARFS_INODE(inode)->inode_data[DWARFS_INODE_INDIR];
-        created = true;
+    if(i == 1)
+        nextblock = dinode_i->inode_data[DWARFS_INODE_INDIR];
+    if(!dwarfs_valid_blockno(sb, nextblock)) {
+        if(!create)
+            return NULL;
+        if((newblock = dwarfs_data_alloc(sb, inode)) < 0)
+            return ERR_PTR(newblock);
+        DWARFS_INODE(inode)->inode_data[DWARFS_INODE_INDIR] = newblock;
+        nextblock = newblock;
+        mark_inode_dirty(inode);
     }
-    for(i = 1; i < depth; i++) { // Traverse the lists until we get to the desired depth
-        indirbh = sb_bread(sb, nextblock);
+    for(; i < depth; i++) { // Traverse the lists until we get to the desired depth
+        if(!(indirbh = sb_bread(sb, nextblock))) {
+            printk("Dwarfs: couldn't read list block %llu\n", nextblock);
+            return ERR_PTR(-EIO);
+        }
         blocknums = (__le64 *)indirbh->b_data;
         nextblock = blocknums[nextptrloc];
-        if(!nextblock || nextblock > dwarfs_datastart(sb) + dfsb->dwarfs_blockc) { // Need to allocate next list
+        if(!dwarfs_valid_blockno(sb, nextblock)) { // Need to allocate next list
             if(!create) {
                 brelse(indirbh);
-		printk("Dwarfs: List entry doesn't exist while create is FALSE (Depth %d of %d)\n", i, depth);
-                return -EIO;
-            }               
-            blocknums[nextptrloc] = dwarfs_data_alloc(sb, inode);
-            nextblock = blocknums[nextptrloc];
-            created = true;
+                return NULL;
+            }
+            if((newblock = dwarfs_data_alloc(sb, inode)) < 0) {
+                brelse(indirbh);
+                return ERR_PTR(newblock);
+            }
+            blocknums[nextptrloc] = newblock;
+            nextblock = newblock;
+            dwarfs_write_buffer(&indirbh, sb);
+            continue;
         }
-        blocknums = NULL;
         brelse(indirbh);
     }
-    indirbh = sb_bread(sb, nextblock); // The block we actually want
-    if(!indirbh) {
+    if(!(indirbh = sb_bread(sb, nextblock))) { // The block we actually want
 	printk("Dwarfs: couldn't grab data block buffer\n");
-        return -EIO;
-    }	
-    blocknums = (__le64 *)indirbh->b_data;
-    if(!(blocknums[offset]) || blocknums[offset] > dwarfs_datastart(sb) + dfsb->dwarfs_blockc) {
-        if(!create) {
-	    printk("Dwarfs: Indir block %llu doesn't exist, but create is FALSE\n", blocknums[offset]);
-	    printk("Depth: %d, offset = %lld, inode blocks: %llu\n", i, offset, inode->i_blocks);
-            brelse(indirbh);
-            return -EIO;
+        return ERR_PTR(-EIO);
+    }
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    dinode_i->inode_map_cache.list_depth = depth;
+    dinode_i->inode_map_cache.list_block = nextblock;
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+    *bhp = indirbh;
+    return (__le64 *)indirbh->b_data + offset;
+}
+
+/*
+ * Start reading the indirect list block that maps iblock, if it's the one after the
+ * list cursor. Only a cached cursor block is looked at, this never waits for I/O.
+ */
+static void dwarfs_list_readahead(struct inode *inode, sector_t iblock) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_inode_info *dinode_i = DWARFS_INODE(inode);
+    unsigned nextptrloc = (sb->s_blocksize / sizeof(__le64)) - 1;
+    sector_t depth = 1 + (iblock - DWARFS_INODE_INDIR) / nextptrloc;
+    sector_t list_depth;
+    __le64 list_block;
+    __le64 nextblock = 0;
+    struct buffer_head *bh;
+
+    spin_lock(&dinode_i->inode_map_cache_lock);
+    list_depth = dinode_i->inode_map_cache.list_depth;
+    list_block = dinode_i->inode_map_cache.list_block;
+    spin_unlock(&dinode_i->inode_map_cache_lock);
+
+    if(depth == 1) {
+        nextblock = dinode_i->inode_data[DWARFS_INODE_INDIR];
+    } else if(list_depth && list_depth == depth - 1) {
+        if(!(bh = sb_find_get_block(sb, list_block)))
+            return;
+        if(buffer_uptodate(bh))
+            nextblock = ((__le64 *)bh->b_data)[nextptrloc];
+        brelse(bh);
+    }
+    if(dwarfs_valid_blockno(sb, nextblock))
+        sb_breadahead(sb, nextblock);
+}
+
+/* Prefetch the metadata needed to map iblock, ahead of the readahead window that reaches it */
+static void dwarfs_map_readahead(struct inode *inode, sector_t iblock) {
+    if(dwarfs_has_extents(inode))
+        dwarfs_ext_readahead(inode, iblock);
+    else if(iblock >= DWARFS_INODE_INDIR)
+        dwarfs_list_readahead(inode, iblock);
+}
+
+/*
+ * Look up the disk block backing logical block iblock of the inode.
+ * *blockno is set to 0 if no block has been assigned yet, and has DWARFS_BLOCK_UNWRITTEN
+ * set if the block was preallocated but never written.
+ */
+static int dwarfs_lookup_block(struct inode *inode, sector_t iblock, __le64 *blockno) {
+    struct buffer_head *bh = NULL;
+    unsigned long len;
+    __le64 *slot;
+
+    if(dwarfs_has_extents(inode))
+        return dwarfs_ext_map(inode, iblock, 1, blockno, &len);
+    *blockno = 0;
+    if(iblock < DWARFS_INODE_INDIR) { // iblock <= 13 means we're using a direct block
+        if(dwarfs_valid_blockno(inode->i_sb, DWARFS_INODE(inode)->inode_data[iblock]))
+            *blockno = DWARFS_INODE(inode)->inode_data[iblock];
+        return 0;
+    }
+    slot = dwarfs_get_indirect_slot(inode, iblock - DWARFS_INODE_INDIR, 0, &bh);
+    if(IS_ERR(slot))
+        return PTR_ERR(slot);
+    if(slot && dwarfs_valid_blockno(inode->i_sb, *slot))
+        *blockno = *slot;
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Record blockno as the disk block backing logical block iblock of the inode,
+ * extending the indirect list as needed.
+ */
+static int dwarfs_set_block(struct inode *inode, sector_t iblock, __le64 blockno) {
+    struct buffer_head *bh = NULL;
+    __le64 *slot;
+
+    if(iblock < DWARFS_INODE_INDIR) {
+        DWARFS_INODE(inode)->inode_data[iblock] = blockno;
+        mark_inode_dirty(inode);
+        return 0;
+    }
+    slot = dwarfs_get_indirect_slot(inode, iblock - DWARFS_INODE_INDIR, 1, &bh);
+    if(IS_ERR(slot))
+        return PTR_ERR(slot);
+    *slot = blockno;
+    dwarfs_write_buffer(&bh, inode->i_sb);
+    return 0;
+}
+
+/*
+ * Follow the pointers from iblock on, at most max of them, for as long as they continue
+ * the run of the first one: contiguous on disk in the same state, or holes after a hole.
+ * The list cursor keeps this from walking the indirect list again for every block.
+ */
+static int dwarfs_lookup_run(struct inode *inode, sector_t iblock, unsigned long max, __le64 *blockno, unsigned long *len) {
+    __le64 next;
+    int err;
+
+    *len = 1;
+    if((err = dwarfs_lookup_block(inode, iblock, blockno)))
+        return err;
+    for(; *len < max; (*len)++) {
+        if(dwarfs_lookup_block(inode, iblock + *len, &next)) // The run ends here, the caller gets the rest later
+            break;
+        if(next != (*blockno ? *blockno + *len : 0))
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Like dwarfs_lookup_block, but also set *len to the number of blocks from iblock on,
+ * at most max, that are in the same state and contiguous on disk.
+ * Lookups go through the map cache, which holds the whole run found by the last miss.
+ */
+static int dwarfs_map_blocks(struct inode *inode, sector_t iblock, unsigned long max, __le64 *blockno, unsigned long *len) {
+    unsigned long seq;
+    int err;
+
+    if(dwarfs_map_cache_lookup(inode, iblock, max, blockno, len))
+        return 0;
+    seq = dwarfs_map_cache_seq(inode);
+    if(dwarfs_has_extents(inode)) {
+        err = dwarfs_ext_map(inode, iblock, DWARFS_EXT_MAX_LEN, blockno, len);
+    } else {
+        err = dwarfs_lookup_run(inode, iblock, max, blockno, len);
+    }
+    if(err)
+        return err;
+    dwarfs_map_cache_store(inode, seq, iblock, *blockno, *len);
+    *len = min(*len, max);
+    return 0;
+}
+
+/*
+ * Map the count logical blocks from iblock to the newly allocated disk blocks from blockno.
+ * Blockno may carry DWARFS_BLOCK_UNWRITTEN, which then applies to the whole run.
+ * On failure the blocks that didn't get mapped are freed again, the ones that did stay.
+ */
+static int dwarfs_set_blocks(struct inode *inode, sector_t iblock, __le64 blockno, unsigned long count) {
+    unsigned long i = 0;
+    int err = 0;
+
+    if(blockno & DWARFS_BLOCK_UNWRITTEN) {
+        DWARFS_INODE(inode)->inode_flags |= DWARFS_UNWRITTEN_FL;
+        mark_inode_dirty(inode);
+    }
+    if(dwarfs_has_extents(inode)) {
+        err = dwarfs_ext_insert(inode, iblock, dwarfs_blockptr_blockno(blockno), count, blockno & DWARFS_BLOCK_UNWRITTEN, &i);
+    } else {
+        for(; i < count; i++)
+            if((err = dwarfs_set_block(inode, iblock + i, blockno + i)))
+                break;
+    }
+    dwarfs_map_cache_invalidate(inode, iblock, iblock + count, false);
+    if(err) {
+        dwarfs_data_free_blocks(inode->i_sb, dwarfs_blockptr_blockno(blockno) + i, count - i);
+        inode->i_blocks -= count - i;
+        mark_inode_dirty(inode);
+    }
+    return err;
+}
+
+/* Clear the unwritten flag of the count preallocated blocks from iblock, backed from blockno */
+static int dwarfs_convert_blocks(struct inode *inode, sector_t iblock, __le64 blockno, unsigned long count) {
+    unsigned long i;
+    int err = 0;
+
+    if(dwarfs_has_extents(inode)) {
+        err = dwarfs_ext_convert(inode, iblock, count);
+    } else {
+        for(i = 0; i < count && !err; i++)
+            err = dwarfs_set_block(inode, iblock + i, blockno + i);
+    }
+    dwarfs_map_cache_invalidate(inode, iblock, iblock + count, false);
+    return err;
+}
+
+/*
+ * Mark every preallocated block among logical blocks [iblock, end) written, once
+ * direct I/O or writeback has put data in them.
+ */
+int dwarfs_convert_range(struct inode *inode, sector_t iblock, sector_t end) {
+    __le64 blockno;
+    unsigned long len;
+    int err;
+
+    while(iblock < end) {
+        if((err = dwarfs_map_blocks(inode, iblock, end - iblock, &blockno, &len)))
+            return err;
+        if((blockno & DWARFS_BLOCK_UNWRITTEN) && (err = dwarfs_convert_blocks(inode, iblock, dwarfs_blockptr_blockno(blockno), len)))
+            return err;
+        iblock += len;
+    }
+    return 0;
+}
+
+/*
+ * Write to a run of count preallocated blocks. They're mapped as a new buffer, so the parts
+ * of them the write doesn't cover get zeroed, and stay unwritten in the block map until
+ * writeback of the buffer completes, see dwarfs_end_buffer_async_write.
+ */
+static void dwarfs_map_unwritten(struct inode *inode, __le64 blockptr, unsigned long count, struct buffer_head *bh_result) {
+    map_bh(bh_result, inode->i_sb, dwarfs_blockptr_blockno(blockptr));
+    set_buffer_new(bh_result);
+    set_buffer_unwritten(bh_result);
+    bh_result->b_size = count << inode->i_blkbits;
+}
+
+/*
+ * Count the delayed buffers of a page, starting at buffer first, up to max.
+ */
+static unsigned long dwarfs_page_delayed(struct page *page, unsigned int first, unsigned long max) {
+    struct buffer_head *head, *bh;
+    unsigned int i = 0;
+    unsigned long n = 0;
+
+    if(!page_has_buffers(page))
+        return 0;
+    head = bh = page_buffers(page);
+    do {
+        if(i++ >= first) {
+            if(n >= max || !buffer_delay(bh))
+                break;
+            n++;
+        }
+        bh = bh->b_this_page;
+    } while(bh != head);
+    return n;
+}
+
+/*
+ * Size the allocation for delayed block iblock, whose buffer is bh, by looking ahead
+ * in the page cache for the delayed blocks that directly follow it.
+ * The page holding bh is locked by writeback, later pages are skipped if they're busy.
+ */
+static unsigned long dwarfs_delayed_run(struct inode *inode, sector_t iblock, struct buffer_head *bh) {
+    unsigned int bppbits = PAGE_SHIFT - inode->i_blkbits;
+    unsigned int bpp = 1 << bppbits;
+    unsigned int first = (iblock & (bpp - 1)) + 1;
+    unsigned long count = 1;
+    unsigned long n;
+    pgoff_t index = iblock >> bppbits;
+    struct page *page = NULL;
+
+    n = dwarfs_page_delayed(bh->b_page, first, DWARFS_MAX_DELALLOC_RUN - count);
+    count += n;
+    if(first + n < bpp)
+        return count;
+
+    while(count < DWARFS_MAX_DELALLOC_RUN) {
+        if(!(page = find_get_page(inode->i_mapping, ++index)))
+            break;
+        if(!trylock_page(page)) {
+            put_page(page);
+            break;
         }
-        blocknums[offset] = dwarfs_data_alloc(sb, inode);
-        created = true;
+        n = page->mapping == inode->i_mapping ? dwarfs_page_delayed(page, 0, DWARFS_MAX_DELALLOC_RUN - count) : 0;
+        unlock_page(page);
+        put_page(page);
+        count += n;
+        if(n < bpp)
+            break;
     }
-    ret = blocknums[offset];
-    blocknums = NULL;
-    if(created) dwarfs_write_buffer(&indirbh, sb);
-    else brelse(indirbh);
-    return ret;
+    return count;
 }
 
+/*
+ * Map logical block iblock of the inode into bh_result, allocating it if create is set.
+ * When the caller maps more than one block (bh_result->b_size), the longest run of blocks
+ * from iblock on that is contiguous on disk is mapped at once, so mpage and direct I/O
+ * build large bios. Unmapped blocks from iblock onwards are allocated as a single
+ * contiguous run, and preallocated ones are converted as a run.
+ * Writeback of a delayed block allocates the whole delayed range following it instead,
+ * and hands the space reserved for the block back.
+ * New blocks are returned as new buffers, their old contents are never read.
+ */
 int dwarfs_get_iblock(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    struct super_block *sb = inode->i_sb;
+    unsigned long maxblocks = bh_result->b_size >> inode->i_blkbits;
+    unsigned long count;
+    bool delayed = create && buffer_delay(bh_result);
+    unsigned long mapped;
     __le64 resultblock;
-    if(iblock < DWARFS_INODE_INDIR) { // iblock <= 13 means we're using a direct block
-        if(DWARFS_INODE(inode)->inode_data[iblock] <= 0) {
-            if(create)
-                DWARFS_INODE(inode)->inode_data[iblock] = dwarfs_data_alloc(inode->i_sb, inode); // TODO: allocate multiple blocks at once
-            else {
-                printk("Dwarfs: Encountered invalid blocknum on !create: %llu\n", DWARFS_INODE(inode)->inode_data[iblock]);
-                return -EIO;
-            }
+    int64_t newblock;
+    int err;
+
+    if((err = dwarfs_map_blocks(inode, iblock, maxblocks, &resultblock, &mapped)))
+        return err;
+    if(resultblock & DWARFS_BLOCK_UNWRITTEN) {
+        if(!create) { // Left unmapped, so it reads back as zeroes
+            bh_result->b_size = mapped << inode->i_blkbits;
+            return 0;
+        }
+        dwarfs_map_unwritten(inode, resultblock, mapped, bh_result);
+        if(delayed)
+            dwarfs_release_block(inode, iblock);
+        return 0;
+    }
+    if(resultblock) {
+        map_bh(bh_result, sb, resultblock);
+        bh_result->b_size = mapped << inode->i_blkbits;
+        if(delayed)
+            dwarfs_release_block(inode, iblock);
+        return 0;
+    }
+    if(!create) { // A hole, e.g. a punched one, reads back as zeroes. Tell direct I/O how long it is
+        bh_result->b_size = mapped << inode->i_blkbits;
+        return 0;
+    }
+
+    /* Allocate every unmapped block the caller asked for in one go */
+    count = mapped;
+    if(delayed)
+        maxblocks = dwarfs_delayed_run(inode, iblock, bh_result);
+    while(count < maxblocks) {
+        if((err = dwarfs_map_blocks(inode, iblock + count, maxblocks - count, &resultblock, &mapped)))
+            return err;
+        if(resultblock)
+            break;
+        count += mapped;
+    }
+    if((newblock = dwarfs_data_alloc_blocks(sb, inode, &count)) < 0)
+        return newblock;
+    if((err = dwarfs_set_blocks(inode, iblock, newblock, count)))
+        return err;
+    if(delayed) {
+        dwarfs_release_block(inode, iblock);
+        count = 1; // Writeback maps one buffer at a time, the rest is found through the lookup
+    }
+    map_bh(bh_result, sb, newblock);
+    set_buffer_new(bh_result); // Not zeroed on disk, let the caller zero what it doesn't write
+    bh_result->b_size = count << inode->i_blkbits;
+    return 0;
+}
+
+/*
+ * get_block for buffered writes with delayed allocation. Unmapped blocks are only
+ * reserved here, and get a disk block when they are written back.
+ */
+static int dwarfs_get_iblock_delalloc(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    unsigned long mapped;
+    __le64 resultblock;
+    int err;
+
+    if((err = dwarfs_map_blocks(inode, iblock, 1, &resultblock, &mapped)))
+        return err;
+    if(resultblock & DWARFS_BLOCK_UNWRITTEN) {
+        dwarfs_map_unwritten(inode, resultblock, 1, bh_result);
+        return 0;
+    }
+    if(resultblock) {
+        map_bh(bh_result, inode->i_sb, resultblock);
+        return 0;
+    }
+    if((err = dwarfs_reserve_block(inode, iblock)))
+        return err;
+    map_bh(bh_result, inode->i_sb, DWARFS_DELALLOC_BLOCK);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
+
+/*
+ * Preallocate disk blocks for the holes among logical blocks [iblock, end) of the inode.
+ * The blocks aren't zeroed on disk, they're marked unwritten instead.
+ */
+int dwarfs_prealloc_range(struct inode *inode, sector_t iblock, sector_t end) {
+    __le64 resultblock;
+    int64_t newblock;
+    unsigned long count, mapped;
+    int err;
+
+    while(iblock < end) {
+        if((err = dwarfs_map_blocks(inode, iblock, end - iblock, &resultblock, &mapped)))
+            return err;
+        if(resultblock) {
+            iblock += mapped;
+            continue;
+        }
+        count = mapped;
+        while(iblock + count < end && count < DWARFS_MAX_DELALLOC_RUN) {
+            if((err = dwarfs_map_blocks(inode, iblock + count, end - iblock - count, &resultblock, &mapped)))
+                return err;
+            if(resultblock)
+                break;
+            count += mapped;
+        }
+        count = min_t(unsigned long, count, DWARFS_MAX_DELALLOC_RUN);
+        if((newblock = dwarfs_data_alloc_blocks(inode->i_sb, inode, &count)) < 0)
+            return newblock;
+        if((err = dwarfs_set_blocks(inode, iblock, newblock | DWARFS_BLOCK_UNWRITTEN, count)))
+            return err;
+        iblock += count;
+    }
+    return 0;
+}
+
+/*
+ * Free the disk blocks backing logical blocks [iblock, end) of the inode, leaving a hole.
+ * Only the pointers and the bitmap are touched, the blocks of the indirect list stay.
+ */
+int dwarfs_free_range(struct inode *inode, sector_t iblock, sector_t end) {
+    struct super_block *sb = inode->i_sb;
+    sector_t start = iblock;
+    struct buffer_head *bh = NULL;
+    struct dwarfs_free_batch batch = { 0 };
+    loff_t size = min_t(loff_t, i_size_read(inode), DWARFS_INLINE_MAX);
+    __le64 *slot;
+    __le64 blockno;
+    int err = 0, flusherr;
+
+    if(dwarfs_has_inline_data(inode)) { // There are no blocks, just zero the bytes
+        if(((loff_t)iblock << inode->i_blkbits) < size)
+            memset((char *)DWARFS_INODE(inode)->inode_data + (iblock << inode->i_blkbits), 0,
+                   min_t(loff_t, size, (loff_t)end << inode->i_blkbits) - (iblock << inode->i_blkbits));
+        mark_inode_dirty(inode);
+        return 0;
+    }
+    if(dwarfs_has_extents(inode)) {
+        err = dwarfs_ext_remove(inode, iblock, end, &batch);
+        goto flush;
+    }
+    for(; iblock < end && iblock < DWARFS_INODE_INDIR; iblock++) {
+        blockno = DWARFS_INODE(inode)->inode_data[iblock];
+        if(!dwarfs_valid_blockno(sb, blockno))
+            continue;
+        DWARFS_INODE(inode)->inode_data[iblock] = 0;
+        inode->i_blocks--;
+        mark_inode_dirty(inode);
+        if((err = dwarfs_free_batch_add(sb, &batch, dwarfs_blockptr_blockno(blockno))))
+            goto flush;
+    }
+    for(; iblock < end; iblock++) {
+        slot = dwarfs_get_indirect_slot(inode, iblock - DWARFS_INODE_INDIR, 0, &bh);
+        if(IS_ERR(slot)) {
+            err = PTR_ERR(slot);
+            break;
         }
-        resultblock = DWARFS_INODE(inode)->inode_data[iblock];
-    } else { // We're using indirect blocks!
-        resultblock = dwarfs_get_indirect_blockno(inode, iblock - (DWARFS_INODE_INDIR), create);
+        if(!slot) // The list ends before iblock, so there's nothing left to free
+            break;
+        blockno = *slot;
+        if(!dwarfs_valid_blockno(sb, blockno)) {
+            brelse(bh);
+            continue;
+        }
+        *slot = 0;
+        dwarfs_write_buffer(&bh, sb);
+        inode->i_blocks--;
+        mark_inode_dirty(inode);
+        if((err = dwarfs_free_batch_add(sb, &batch, dwarfs_blockptr_blockno(blockno))))
+            goto flush;
+    }
+flush:
+    dwarfs_map_cache_invalidate(inode, start, end, false);
+    // The pointers to the batched blocks are gone already, free them even after an error
+    flusherr = dwarfs_free_batch_flush(sb, &batch);
+    return err ? err : flusherr;
+}
+
+/*
+ * iomap mapping, used by direct I/O, buffered reads and writes, page_mkwrite, fiemap,
+ * bmap and lseek. This kernel has no iomap writeback, so buffered writes keep buffer
+ * heads on their pages for writepage to map.
+ * Direct writes into holes allocate unwritten blocks, which the write converts once
+ * its data is on disk, so a failed write never exposes stale blocks. Buffered writes
+ * allocate written blocks, the same as get_block does.
+ */
+static int dwarfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length, unsigned int flags, struct iomap *iomap) {
+    unsigned int blkbits = inode->i_blkbits;
+    sector_t iblock = offset >> blkbits;
+    sector_t end = ((u64)offset + length + (1 << blkbits) - 1) >> blkbits;
+    sector_t eof = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+    unsigned long len;
+    __le64 blockno;
+    int64_t newblock;
+    int err;
+
+    iomap->flags = 0;
+    iomap->bdev = inode->i_sb->s_bdev;
+    if((flags & IOMAP_WRITE) && !(flags & IOMAP_DIRECT))
+        iomap->flags |= IOMAP_F_BUFFER_HEAD;
+    if(dwarfs_has_inline_data(inode)) { // Direct I/O falls back to buffered, so this only serves reports
+        if(offset < i_size_read(inode)) {
+            iomap->type = IOMAP_INLINE;
+            iomap->addr = IOMAP_NULL_ADDR;
+            iomap->inline_data = DWARFS_INODE(inode)->inode_data;
+            iomap->offset = 0;
+            iomap->length = i_size_read(inode);
+            return 0;
+        }
+        // The pointers hold file data, never look them up as blocks
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->offset = offset;
+        iomap->length = length;
+        return 0;
+    }
+    if(!(flags & IOMAP_WRITE)) {
+        if(iblock >= eof) { // Nothing is mapped past the end of the file
+            iomap->type = IOMAP_HOLE;
+            iomap->addr = IOMAP_NULL_ADDR;
+            iomap->offset = offset;
+            iomap->length = length;
+            return 0;
+        }
+        end = min(end, eof);
+    }
+    if((err = dwarfs_map_blocks(inode, iblock, min_t(sector_t, end - iblock, DWARFS_EXT_MAX_LEN), &blockno, &len)))
+        return err;
+    if(!blockno && (flags & IOMAP_WRITE)) {
+        len = min_t(unsigned long, len, DWARFS_MAX_DELALLOC_RUN);
+        if((newblock = dwarfs_data_alloc_blocks(inode->i_sb, inode, &len)) < 0)
+            return newblock;
+        blockno = flags & IOMAP_DIRECT ? newblock | DWARFS_BLOCK_UNWRITTEN : newblock;
+        if((err = dwarfs_set_blocks(inode, iblock, blockno, len)))
+            return err;
+        mark_inode_dirty(inode);
+        // Freed directory and list blocks may still have dirty buffers that would overwrite the data
+        clean_bdev_aliases(inode->i_sb->s_bdev, newblock, len);
+        iomap->flags |= IOMAP_F_NEW;
+    }
+
+    iomap->offset = (u64)iblock << blkbits;
+    iomap->length = (u64)len << blkbits;
+    if(!blockno) {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        return 0;
     }
-    map_bh(bh_result, inode->i_sb, resultblock);
-	return 0;
+    iomap->type = blockno & DWARFS_BLOCK_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+    iomap->addr = (u64)dwarfs_blockptr_blockno(blockno) << blkbits;
+    return 0;
+}
+
+/*
+ * A short buffered write leaves blocks allocated by iomap_begin that got no data,
+ * give them back so they don't stay mapped past the end of the file.
+ */
+static int dwarfs_iomap_end(struct inode *inode, loff_t offset, loff_t length, ssize_t written, unsigned int flags, struct iomap *iomap) {
+    unsigned int blkbits = inode->i_blkbits;
+    loff_t start, end;
+
+    if(iomap->flags & IOMAP_F_SIZE_CHANGED)
+        mark_inode_dirty(inode);
+    if(!(iomap->flags & IOMAP_F_BUFFER_HEAD) || !(iomap->flags & IOMAP_F_NEW) || (flags & IOMAP_FAULT) || written >= length)
+        return 0;
+    start = round_up(offset + written, 1 << blkbits);
+    end = iomap->offset + iomap->length;
+    if(start >= end)
+        return 0;
+    truncate_pagecache_range(inode, start, end - 1);
+    return dwarfs_free_range(inode, start >> blkbits, end >> blkbits);
 }
 
+const struct iomap_ops dwarfs_iomap_ops = {
+    .iomap_begin    = dwarfs_iomap_begin,
+    .iomap_end      = dwarfs_iomap_end,
+};
+
+/*
+ * iomap only leaves buffer heads alone when a block fills the page, it keeps no per block
+ * state then. Pages that already have buffers, e.g. after a failed write, go through mpage.
+ */
 static int dwarfs_readpage(struct file *file, struct page *page) {
+    struct inode *inode = page->mapping->host;
+
+    if(dwarfs_has_inline_data(inode))
+        return dwarfs_inline_readpage(inode, page);
+    if(i_blocksize(inode) == PAGE_SIZE && !page_has_buffers(page))
+        return iomap_readpage(page, &dwarfs_iomap_ops);
     return mpage_readpage(page, dwarfs_get_iblock);
 }
 
+/*
+ * iomap_begin maps whole contiguous runs, so each run of the window is read with one bio.
+ * The mapping metadata for the block after the window is prefetched, so the next
+ * window doesn't stall on an indirect list block or extent leaf.
+ */
 static int dwarfs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages) {
+    struct inode *inode = mapping->host;
+    pgoff_t end;
+
+    if(dwarfs_has_inline_data(inode)) // Nothing to read ahead, readpage copies from the inode
+        return 0;
+    end = list_first_entry(pages, struct page, lru)->index + 1; // The list runs backwards, its head is the last page
+    dwarfs_map_readahead(inode, (sector_t)end << (PAGE_SHIFT - inode->i_blkbits));
+    if(i_blocksize(inode) == PAGE_SIZE)
+        return iomap_readpages(mapping, pages, nr_pages, &dwarfs_iomap_ops);
     return mpage_readpages(mapping, pages, nr_pages, dwarfs_get_iblock);
 }
 
-static ssize_t dwarfs_direct_io(struct kiocb *iocb, struct iov_iter *iter) {
-    struct inode *inode = file_inode(iocb->ki_filp);
-	return blockdev_direct_IO(iocb, inode, iter, dwarfs_get_iblock);
+/*
+ * Mark the blocks of written back buffers of preallocated blocks written, and finish their
+ * writeback. Consecutive blocks of a file are converted as a run.
+ */
+static void dwarfs_unwritten_worker(struct work_struct *work) {
+    struct dwarfs_superblock_info *dfsb_i = container_of(work, struct dwarfs_superblock_info, dwarfs_unwritten_work);
+    struct buffer_head *bh, *next, *done = NULL, *first;
+    struct inode *inode;
+    sector_t iblock, end;
+    int err;
+
+    spin_lock_irq(&dfsb_i->dwarfs_unwritten_lock);
+    bh = dfsb_i->dwarfs_unwritten_list;
+    dfsb_i->dwarfs_unwritten_list = NULL;
+    spin_unlock_irq(&dfsb_i->dwarfs_unwritten_lock);
+
+    for(; bh; bh = next) { // The list is newest first, put it back in completion order
+        next = bh->b_private;
+        bh->b_private = done;
+        done = bh;
+    }
+    while(done) {
+        first = done;
+        inode = first->b_page->mapping->host;
+        iblock = ((sector_t)first->b_page->index << (PAGE_SHIFT - inode->i_blkbits)) + (bh_offset(first) >> inode->i_blkbits);
+        end = iblock + 1;
+        for(bh = first->b_private; bh && bh->b_page->mapping->host == inode; bh = bh->b_private, end++) {
+            if(((sector_t)bh->b_page->index << (PAGE_SHIFT - inode->i_blkbits)) + (bh_offset(bh) >> inode->i_blkbits) != end)
+                break;
+        }
+        if((err = dwarfs_convert_range(inode, iblock, end))) { // The data is on disk, but reads still see zeroes
+            printk("Dwarfs: couldn't mark blocks %llu-%llu of inode %lu written: %d\n",
+                   (unsigned long long)iblock, (unsigned long long)end - 1, inode->i_ino, err);
+            mapping_set_error(inode->i_mapping, err);
+        }
+        for(; done != bh; done = next) {
+            next = done->b_private;
+            done->b_private = NULL;
+            if(!err)
+                clear_buffer_unwritten(done);
+            end_buffer_async_write(done, 1);
+        }
+    }
+}
+
+/*
+ * Writeback completion of a buffer. Buffers of preallocated blocks still have to be marked
+ * written, which needs process context, so they're handed to the unwritten worker. Their
+ * page stays under writeback until it's done, so fsync waits for the block map too.
+ */
+static void dwarfs_end_buffer_async_write(struct buffer_head *bh, int uptodate) {
+    struct dwarfs_superblock_info *dfsb_i;
+    unsigned long flags;
+
+    if(!uptodate || !buffer_unwritten(bh)) {
+        end_buffer_async_write(bh, uptodate);
+        return;
+    }
+    dfsb_i = DWARFS_SB(bh->b_page->mapping->host->i_sb);
+    spin_lock_irqsave(&dfsb_i->dwarfs_unwritten_lock, flags);
+    bh->b_private = dfsb_i->dwarfs_unwritten_list;
+    dfsb_i->dwarfs_unwritten_list = bh;
+    spin_unlock_irqrestore(&dfsb_i->dwarfs_unwritten_lock, flags);
+    queue_work(dfsb_i->dwarfs_unwritten_wq, &dfsb_i->dwarfs_unwritten_work);
 }
 
+int dwarfs_unwritten_init(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+
+    spin_lock_init(&dfsb_i->dwarfs_unwritten_lock);
+    dfsb_i->dwarfs_unwritten_list = NULL;
+    INIT_WORK(&dfsb_i->dwarfs_unwritten_work, dwarfs_unwritten_worker);
+    dfsb_i->dwarfs_unwritten_wq = alloc_workqueue("dwarfs-unwritten/%s", WQ_MEM_RECLAIM, 1, sb->s_id);
+    if(!dfsb_i->dwarfs_unwritten_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+void dwarfs_unwritten_destroy(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+
+    if(dfsb_i->dwarfs_unwritten_wq) {
+        destroy_workqueue(dfsb_i->dwarfs_unwritten_wq);
+        dfsb_i->dwarfs_unwritten_wq = NULL;
+    }
+}
+
+static void dwarfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length);
+
+/*
+ * Like block_write_full_page, but completes the buffers through dwarfs_end_buffer_async_write,
+ * so preallocated blocks are marked written only once their data is on disk.
+ */
 static int dwarfs_writepage(struct page *pg, struct writeback_control *wbc) {
-    return block_write_full_page(pg, dwarfs_get_iblock, wbc);
+    struct inode *inode = pg->mapping->host;
+    loff_t size = i_size_read(inode);
+    pgoff_t end_index = size >> PAGE_SHIFT;
+
+    if(dwarfs_has_inline_data(inode))
+        return dwarfs_inline_writepage(pg);
+    if(pg->index >= end_index) {
+        if(pg->index > end_index || !(size & ~PAGE_MASK)) { // Wholly past the end, truncate is dropping it
+            dwarfs_invalidatepage(pg, 0, PAGE_SIZE);
+            unlock_page(pg);
+            return 0;
+        }
+        zero_user_segment(pg, size & ~PAGE_MASK, PAGE_SIZE); // Straddles the end, the tail must read back as zeroes
+    }
+    return __block_write_full_page(inode, pg, dwarfs_get_iblock, wbc, dwarfs_end_buffer_async_write);
 }
 
+/*
+ * With delalloc, pages may hold delayed buffers that mpage can't map, so every page
+ * goes through writepage. The first delayed block of a dirty range allocates the whole range.
+ * mpage doesn't know about unwritten buffers either, files with preallocated blocks go
+ * through writepage too.
+ */
 static int dwarfs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    struct inode *inode = mapping->host;
+
+    if(dwarfs_test_opt(inode->i_sb, DWARFS_MOUNT_DELALLOC) || dwarfs_has_inline_data(inode) ||
+       (DWARFS_INODE(inode)->inode_flags & DWARFS_UNWRITTEN_FL))
+        return generic_writepages(mapping, wbc);
     return mpage_writepages(mapping, wbc, dwarfs_get_iblock);
 }
 
+/* Block mapped files on mounts without delalloc are written through iomap, see dwarfs_buffered_write_iter */
 static int dwarfs_write_begin(struct file *file, struct address_space *mapping, loff_t offset,
                 unsigned int len, unsigned int flags, struct page **pagelist, void **fsdata) {
+    int err;
+
+    if(dwarfs_has_inline_data(mapping->host)) {
+        if(offset + len <= DWARFS_INLINE_MAX)
+            return dwarfs_inline_write_begin(mapping, offset, len, flags, pagelist);
+        if((err = dwarfs_inline_convert(mapping->host)))
+            return err;
+    }
+    if(dwarfs_test_opt(mapping->host->i_sb, DWARFS_MOUNT_DELALLOC))
+        return block_write_begin(mapping, offset, len, flags, pagelist, dwarfs_get_iblock_delalloc);
     return block_write_begin(mapping, offset, len, flags, pagelist, dwarfs_get_iblock);
 }
 
+/*
+ * Hand back the space reserved for delayed buffers that are dropped from the page cache
+ * before they were written back, e.g. when a file is truncated or deleted.
+ */
+static void dwarfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length) {
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *head, *bh;
+    sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+    unsigned int curr_off = 0;
+    unsigned int stop = offset + length;
+
+    if(page_has_buffers(page)) {
+        head = bh = page_buffers(page);
+        do {
+            if(curr_off >= offset && curr_off + bh->b_size <= stop && buffer_delay(bh))
+                dwarfs_release_block(inode, iblock);
+            curr_off += bh->b_size;
+            iblock++;
+            bh = bh->b_this_page;
+        } while(bh != head);
+    }
+    block_invalidatepage(page, offset, length);
+}
+
 static int dwarfs_write_end(struct file *file, struct address_space *mapping, loff_t offset,
                 unsigned int len, unsigned int copied, struct page *pg, void *fsdata) {
+    if(dwarfs_has_inline_data(mapping->host))
+        return dwarfs_inline_write_end(mapping->host, offset, copied, pg);
     return generic_write_end(file, mapping, offset, len, copied, pg, fsdata);
 }
 
 static sector_t dwarfs_bmap(struct address_space *mapping, sector_t block) {
-    return generic_block_bmap(mapping, block, dwarfs_get_iblock);
+    return iomap_bmap(mapping, block, &dwarfs_iomap_ops);
+}
+
+/*
+ * First write to a page of a shared mapping. Its blocks are allocated, or reserved
+ * with delalloc, here rather than at writeback, which can't report ENOSPC.
+ * Inline files have nothing to allocate, writeback copies page 0 into the inode.
+ * Delalloc mounts reserve in get_block, see dwarfs_buffered_write_iter for why.
+ */
+vm_fault_t dwarfs_page_mkwrite(struct vm_fault *vmf) {
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    vm_fault_t ret;
+
+    if(dwarfs_has_inline_data(inode))
+        return filemap_page_mkwrite(vmf);
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    if(dwarfs_test_opt(inode->i_sb, DWARFS_MOUNT_DELALLOC))
+        ret = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf, dwarfs_get_iblock_delalloc));
+    else
+        ret = iomap_page_mkwrite(vmf, &dwarfs_iomap_ops);
+    sb_end_pagefault(inode->i_sb);
+    return ret;
 }
 
 const struct address_space_operations dwarfs_aops = {
@@ -523,10 +1327,11 @@ const struct address_space_operations dwarfs_aops = {
 	.readpages		= dwarfs_readpages,
     .writepage      = dwarfs_writepage,
     .writepages     = dwarfs_writepages,
-	.direct_IO      = dwarfs_direct_io,
+	.direct_IO      = noop_direct_IO, // Direct I/O goes through iomap in file.c, this only allows O_DIRECT
     .write_begin    = dwarfs_write_begin,
     .write_end      = dwarfs_write_end,
     .bmap           = dwarfs_bmap,
+    .invalidatepage = dwarfs_invalidatepage,
     .migratepage    = buffer_migrate_page,
     .is_partially_uptodate  = block_is_partially_uptodate,
     .error_remove_page      = generic_error_remove_page,
@@ -28,13 +28,15 @@ static const uint32_t DWARFS_MAGIC = 0xDECAFBAD;
 static const uint8_t DWARFS_MAX_NAME_LEN = 32;
 
 static const int DWARFS_BLOCK_SIZE = 4096; // blocksize in bytes
+static const int DWARFS_BITMAP_BITS = DWARFS_BLOCK_SIZE * 8; // inodes or data blocks tracked per bitmap block
+static const uint64_t DWARFS_VERSION = 2; // on-disk format version, must match the kernel module
 
 static const int DWARFS_SUPERBLOCK_BLOCKNUM = 0;
 static const int DWARFS_INODE_BITMAP_BLOCKNUM = 1;
 static const int DWARFS_DATA_BITMAP_BLOCKNUM = 2;
 static const int DWARFS_FIRST_INODE_BLOCKNUM = 3;
 static const int DWARFS_FIRST_DATA_BLOCKNUM = 8;
-#define DWARFS_SUPERBLOCK_PADDING 3960
+#define DWARFS_SUPERBLOCK_PADDING 3952
 
 static const int DWARFS_NUMBLOCKS = 15; // Default number of block pointers in an inode
 
@@ -64,6 +66,8 @@ struct dwarfs_superblock {
     uint64_t dwarfs_version_num; /* Versions might not matter ... backwards/forwards compatibility???? */
     uint64_t dwarfs_os; /* Which OS created the fs */
 
+    uint64_t dwarfs_last_orphan; /* First inode on the orphan list, 0 if it's empty */
+
     /* Add padding to fill the block? */
     // Answer is yes!
     char padding[DWARFS_SUPERBLOCK_PADDING];
@@ -89,8 +93,10 @@ struct dwarfs_inode {
     uint64_t inode_flags; /* File flags (Remove this if no flags get implemented!) */
 
     uint64_t inode_blocks[DWARFS_NUMBLOCKS]; /* Pointers to data blocks */
+    uint64_t inode_next_orphan; /* Next inode on the orphan list */
+    uint64_t inode_dir_start_lookup; /* First block of a linear directory that may have a free slot */
 
     // Padding to make size 256 (block_size divisible by sizeof(inode))
-    char padding[56];
+    char padding[40];
 };
 #endif
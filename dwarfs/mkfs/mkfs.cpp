@@ -4,7 +4,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ctime>
-#include <math.h>
+#include <cstring>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <fcntl.h>
@@ -52,10 +52,12 @@ int main(int argc, char **argv) {
     metadatablocks = totalblocks / 5; // 1/5 of blocks for metadata
     datablocks = totalblocks - metadatablocks;
 
-    databitmapblocks = ceil(datablocks / (DWARFS_BLOCK_SIZE * 8));
+    // Every bit of a bitmap block tracks one data block or inode
+    databitmapblocks = (datablocks + DWARFS_BITMAP_BITS - 1) / DWARFS_BITMAP_BITS;
     metadatablocks -= (databitmapblocks + 1);
 
-    inodebitmapblocks = ceil(metadatablocks / ((DWARFS_BLOCK_SIZE / inodeperblock) * 8));
+    // Split the rest between the inode bitmap and the inodes it tracks
+    inodebitmapblocks = (metadatablocks * inodeperblock + DWARFS_BITMAP_BITS + inodeperblock - 1) / (DWARFS_BITMAP_BITS + inodeperblock);
     inodeblocks = metadatablocks - inodebitmapblocks;
 
     std::cout << "Volume layout:\n" \
@@ -67,6 +69,7 @@ int main(int argc, char **argv) {
     
 
     // Fill the SB
+    memset(&sb, 0, sizeof(struct dwarfs_superblock));
     sb.dwarfs_magic = DWARFS_MAGIC;
     sb.dwarfs_blockc = datablocks;
     sb.dwarfs_reserved_blocks = 0;
@@ -77,17 +80,15 @@ int main(int argc, char **argv) {
     sb.dwarfs_root_inode = 2;
     sb.dwarfs_inodec = inodeperblock * inodeblocks;
     sb.dwarfs_free_inodes_count = sb.dwarfs_inodec - 3; // reserve the root node
-    sb.dwarfs_data_bitmap_start = sb.dwarfs_inode_bitmap_start + inodebitmapblocks;
     sb.dwarfs_inode_bitmap_start = 1;
+    sb.dwarfs_data_bitmap_start = sb.dwarfs_inode_bitmap_start + inodebitmapblocks;
     sb.dwarfs_wtime = 0;
     sb.dwarfs_mtime = 0;
     sb.dwarfs_def_resgid = 0;
     sb.dwarfs_def_resuid = 0;
-    sb.dwarfs_version_num = 1;
+    sb.dwarfs_version_num = DWARFS_VERSION;
     sb.dwarfs_os = operating_systems::OS_LINUX;
-
-    for(char c : sb.padding)
-        c = 10;
+    sb.dwarfs_last_orphan = 0;
 
     std::ofstream imgfile(argv[1], std::ios::binary | std::ios::out);
     imgfile.write((char*)&sb, sizeof(struct dwarfs_superblock));
@@ -95,22 +96,22 @@ int main(int argc, char **argv) {
     std::cout << "Wrote superblock!" << std::endl;
 
     char emptyblock[DWARFS_BLOCK_SIZE];
-    for(char c : emptyblock)
-        c = 0;
+    memset(emptyblock, 0, DWARFS_BLOCK_SIZE);
     unsigned long *firstlong = (unsigned long*)emptyblock; // 00000111, reserve inodes 0, 1 and 2.
     firstlong[0] = 7;
 
     imgfile.write(emptyblock, DWARFS_BLOCK_SIZE);
     firstlong[0] = 0;
-    for(int i = 1; i < inodebitmapblocks; i++)
+    for(size_t i = 1; i < inodebitmapblocks; i++)
         imgfile.write(emptyblock, DWARFS_BLOCK_SIZE);
     std::cout << "Wrote inode bitmap, size: " << inodebitmapblocks << std::endl;
 
-    for(int i = 0; i < databitmapblocks; i++)
+    for(size_t i = 0; i < databitmapblocks; i++)
         imgfile.write(emptyblock, DWARFS_BLOCK_SIZE);
     std::cout << "Wrote data bitmap, size: " << databitmapblocks << std::endl;
 
     // Fill the iNode
+    memset(&inode_blank, 0, sizeof(struct dwarfs_inode));
     inode_blank.inode_mode = 0;
     inode_blank.inode_size = sizeof(struct dwarfs_inode);
     inode_blank.inode_uid = 0;
@@ -126,14 +127,6 @@ int main(int argc, char **argv) {
 
     std::cout << "Inode size: " << sizeof(struct dwarfs_inode) << std::endl;
 
-    for(uint64_t block : inode_blank.inode_blocks)
-        block = 0;
-    for(uint64_t block : inode_root.inode_blocks)
-        block = 0;
-
-    for(char c : inode_blank.padding)
-        c = 10;
-
     int numnodes = sb.dwarfs_inodec;
 
     for(int i = 0; i < numnodes; i++) {
@@ -0,0 +1,220 @@
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+
+#include "dwarfs.h"
+
+/*
+ * Deleted inodes aren't torn down by whoever drops the last reference. Eviction puts them
+ * on the orphan list instead, which is kept on disk: the superblock points to the newest
+ * orphan, and every orphan points to the next older one through inode_next_orphan.
+ * A per-mount worker frees the blocks of the orphans, oldest first, and only frees an inode
+ * once all its blocks are gone. Orphans still listed at mount time were interrupted by
+ * a crash or an unmount, and are reclaimed before the mount completes.
+ */
+
+/* Point the orphan list entry of ino at next. Ino 0 stands for the head in the superblock */
+static int dwarfs_orphan_link(struct super_block *sb, uint64_t ino, uint64_t next) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct dwarfs_inode *dinode = NULL;
+
+    if(!ino) {
+        dfsb_i->dfsb->dwarfs_last_orphan = cpu_to_le64(next);
+        mark_buffer_dirty(dfsb_i->dwarfs_bufferhead);
+        return 0;
+    }
+    dinode = dwarfs_getdinode(sb, ino, &bh);
+    if(IS_ERR(dinode))
+        return PTR_ERR(dinode);
+    dinode->inode_next_orphan = cpu_to_le64(next);
+    dwarfs_write_buffer(&bh, sb);
+    return 0;
+}
+
+/*
+ * Take an orphan off the list. The in-memory list is in on-disk order, so its neighbours
+ * there are its neighbours on disk. The orphan lock must be held.
+ */
+static int dwarfs_orphan_unlink(struct super_block *sb, struct dwarfs_orphan *orphan) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    uint64_t prev = 0, next = 0;
+
+    if(!list_is_first(&orphan->list, &dfsb_i->dwarfs_orphans))
+        prev = list_prev_entry(orphan, list)->ino;
+    if(!list_is_last(&orphan->list, &dfsb_i->dwarfs_orphans))
+        next = list_next_entry(orphan, list)->ino;
+    list_del(&orphan->list);
+    return dwarfs_orphan_link(sb, prev, next);
+}
+
+/*
+ * Free the blocks of an orphan. Its block pointers are cleared on disk first,
+ * so a crash halfway through leaks blocks instead of freeing them twice.
+ */
+static int dwarfs_orphan_reclaim(struct super_block *sb, struct dwarfs_orphan *orphan) {
+    struct buffer_head *bh = NULL;
+    struct dwarfs_inode *dinode = dwarfs_getdinode(sb, orphan->ino, &bh);
+
+    if(IS_ERR(dinode))
+        return PTR_ERR(dinode);
+    memset(dinode->inode_blocks, 0, sizeof(dinode->inode_blocks));
+    dinode->inode_blockc = 0;
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+
+    if(S_ISLNK(orphan->mode))
+        return 0;
+    return dwarfs_data_dealloc_blocks(sb, orphan->blocks, orphan->flags);
+}
+
+/*
+ * Reclaim orphans until the list is empty. Only one caller runs at a time, either the
+ * worker or the mount, so the oldest orphan stays put while its blocks are freed.
+ */
+static void dwarfs_orphan_reclaim_all(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_orphan *orphan = NULL;
+    int err;
+
+    for(;;) {
+        mutex_lock(&dfsb_i->dwarfs_orphan_lock);
+        if(list_empty(&dfsb_i->dwarfs_orphans)) {
+            mutex_unlock(&dfsb_i->dwarfs_orphan_lock);
+            break;
+        }
+        orphan = list_last_entry(&dfsb_i->dwarfs_orphans, struct dwarfs_orphan, list);
+        mutex_unlock(&dfsb_i->dwarfs_orphan_lock);
+
+        if((err = dwarfs_orphan_reclaim(sb, orphan)))
+            printk("Dwarfs: couldn't free all blocks of orphan inode %llu: %d\n", orphan->ino, err);
+
+        mutex_lock(&dfsb_i->dwarfs_orphan_lock);
+        err = dwarfs_orphan_unlink(sb, orphan);
+        mutex_unlock(&dfsb_i->dwarfs_orphan_lock);
+        if(err)
+            printk("Dwarfs: couldn't take inode %llu off the orphan list: %d\n", orphan->ino, err);
+
+        dwarfs_inode_dealloc(sb, orphan->ino);
+        kfree(orphan);
+        cond_resched();
+    }
+}
+
+static void dwarfs_reclaim_worker(struct work_struct *work) {
+    struct dwarfs_superblock_info *dfsb_i = container_of(work, struct dwarfs_superblock_info, dwarfs_reclaim_work);
+    struct super_block *sb = dfsb_i->dwarfs_sb;
+
+    sb_start_intwrite(sb);
+    dwarfs_orphan_reclaim_all(sb);
+    sb_end_intwrite(sb);
+}
+
+/*
+ * Put an evicted inode with no links left on the orphan list, and have the worker free it.
+ * The inode must have been written back already, its block pointers are copied.
+ */
+int dwarfs_orphan_add(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_orphan *orphan = kmalloc(sizeof(struct dwarfs_orphan), GFP_NOFS);
+    uint64_t next = 0;
+    int err;
+
+    if(!orphan)
+        return -ENOMEM;
+    orphan->ino = inode->i_ino;
+    orphan->mode = inode->i_mode;
+    orphan->flags = DWARFS_INODE(inode)->inode_flags;
+    memcpy(orphan->blocks, DWARFS_INODE(inode)->inode_data, sizeof(orphan->blocks));
+
+    mutex_lock(&dfsb_i->dwarfs_orphan_lock);
+    if(!list_empty(&dfsb_i->dwarfs_orphans))
+        next = list_first_entry(&dfsb_i->dwarfs_orphans, struct dwarfs_orphan, list)->ino;
+    err = dwarfs_orphan_link(sb, orphan->ino, next);
+    if(!err)
+        err = dwarfs_orphan_link(sb, 0, orphan->ino);
+    if(err) {
+        mutex_unlock(&dfsb_i->dwarfs_orphan_lock);
+        kfree(orphan);
+        return err;
+    }
+    list_add(&orphan->list, &dfsb_i->dwarfs_orphans);
+    mutex_unlock(&dfsb_i->dwarfs_orphan_lock);
+
+    queue_work(dfsb_i->dwarfs_reclaim_wq, &dfsb_i->dwarfs_reclaim_work);
+    return 0;
+}
+
+/*
+ * Finish the reclamation of the orphans left on disk by the last mount.
+ */
+int dwarfs_orphan_recover(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    struct dwarfs_orphan *orphan = NULL;
+    struct buffer_head *bh = NULL;
+    struct dwarfs_inode *dinode = NULL;
+    uint64_t inodec = le64_to_cpu(dfsb_i->dfsb->dwarfs_inodec);
+    uint64_t ino = le64_to_cpu(dfsb_i->dfsb->dwarfs_last_orphan);
+    uint64_t count = 0;
+    int err = 0;
+
+    while(ino) {
+        if(ino < DWARFS_FIRST_INODE || ino >= inodec || count >= inodec) {
+            printk("Dwarfs: orphan list is corrupt at inode %llu\n", ino);
+            err = -EFSCORRUPTED;
+            break;
+        }
+        dinode = dwarfs_getdinode(sb, ino, &bh);
+        if(IS_ERR(dinode)) {
+            err = PTR_ERR(dinode);
+            break;
+        }
+        if(!(orphan = kmalloc(sizeof(struct dwarfs_orphan), GFP_KERNEL))) {
+            brelse(bh);
+            err = -ENOMEM;
+            break;
+        }
+        orphan->ino = ino;
+        orphan->mode = le16_to_cpu(dinode->inode_mode);
+        orphan->flags = le64_to_cpu(dinode->inode_flags);
+        memcpy(orphan->blocks, dinode->inode_blocks, sizeof(orphan->blocks));
+        ino = le64_to_cpu(dinode->inode_next_orphan);
+        brelse(bh);
+
+        list_add_tail(&orphan->list, &dfsb_i->dwarfs_orphans);
+        count++;
+    }
+
+    if(count)
+        printk("Dwarfs: reclaiming %llu orphan inodes\n", count);
+    dwarfs_orphan_reclaim_all(sb);
+    return err;
+}
+
+int dwarfs_orphan_init(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+
+    dfsb_i->dwarfs_sb = sb;
+    INIT_LIST_HEAD(&dfsb_i->dwarfs_orphans);
+    mutex_init(&dfsb_i->dwarfs_orphan_lock);
+    INIT_WORK(&dfsb_i->dwarfs_reclaim_work, dwarfs_reclaim_worker);
+    dfsb_i->dwarfs_reclaim_wq = alloc_ordered_workqueue("dwarfs-reclaim/%s", WQ_MEM_RECLAIM, sb->s_id);
+    if(!dfsb_i->dwarfs_reclaim_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+/* Wait for the worker to empty the orphan list, then get rid of it */
+void dwarfs_orphan_destroy(struct super_block *sb) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+
+    if(dfsb_i->dwarfs_reclaim_wq) {
+        destroy_workqueue(dfsb_i->dwarfs_reclaim_wq);
+        dfsb_i->dwarfs_reclaim_wq = NULL;
+    }
+}
@@ -10,6 +10,9 @@
 #include <linux/limits.h>
 #include <linux/quotaops.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
 
 #include "dwarfs.h"
 
@@ -22,6 +25,10 @@ static struct kmem_cache *dwarfs_inode_cacheptr;
 
 static void dwarfs_init_once(void *ptr) {
     struct dwarfs_inode_info *dinode_i = (struct dwarfs_inode_info *)ptr;
+    RB_CLEAR_NODE(&dinode_i->inode_rsv.node);
+    mutex_init(&dinode_i->inode_rsv_lock);
+    init_rwsem(&dinode_i->inode_map_sem);
+    spin_lock_init(&dinode_i->inode_map_cache_lock);
     inode_init_once(&dinode_i->vfs_inode);
 }
 
@@ -42,6 +49,9 @@ static struct inode *dwarfs_ialloc(struct super_block *sb) {
     struct dwarfs_inode_info *dinode_i = kmem_cache_alloc(dwarfs_inode_cacheptr, GFP_KERNEL);
     if(!dinode_i)
         return NULL;
+    dinode_i->inode_rsv.start = dinode_i->inode_rsv.end = 0;
+    dinode_i->inode_rsv.goal_size = DWARFS_RSV_DEFAULT_WINDOW;
+    memset(&dinode_i->inode_map_cache, 0, sizeof(dinode_i->inode_map_cache));
     return &dinode_i->vfs_inode;
 }
 
@@ -51,8 +61,8 @@ void dwarfs_ifree(struct inode *inode) {
 
 void dwarfs_superblock_sync(struct super_block *sb, struct dwarfs_superblock *dfsb, int wait) {
     struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
-    dfsb->dwarfs_free_blocks_count = dfsb_i->dwarfs_free_blocks_count;
-    dfsb->dwarfs_free_inodes_count = dfsb_i->dwarfs_free_inodes_count;
+    dfsb->dwarfs_free_blocks_count = percpu_counter_sum_positive(&dfsb_i->dwarfs_free_blocks_count);
+    dfsb->dwarfs_free_inodes_count = percpu_counter_sum_positive(&dfsb_i->dwarfs_free_inodes_count);
     mark_buffer_dirty(dfsb_i->dwarfs_bufferhead);
     if(wait)
         sync_dirty_buffer(dfsb_i->dwarfs_bufferhead);
@@ -69,6 +79,60 @@ void dwarfs_write_super(struct super_block *sb) {
     dwarfs_superblock_sync(sb, dfsb, 1);
 }
 
+enum {
+    Opt_delalloc, Opt_nodelalloc, Opt_discard, Opt_nodiscard, Opt_err
+};
+
+static const match_table_t dwarfs_tokens = {
+    {Opt_delalloc, "delalloc"},
+    {Opt_nodelalloc, "nodelalloc"},
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_err, NULL}
+};
+
+static int dwarfs_parse_options(struct super_block *sb, char *options) {
+    struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if(!options)
+        return 0;
+
+    while((p = strsep(&options, ",")) != NULL) {
+        if(!*p)
+            continue;
+        switch(match_token(p, dwarfs_tokens, args)) {
+        case Opt_delalloc:
+            dfsb_i->dwarfs_mount_opt |= DWARFS_MOUNT_DELALLOC;
+            break;
+        case Opt_nodelalloc:
+            dfsb_i->dwarfs_mount_opt &= ~DWARFS_MOUNT_DELALLOC;
+            break;
+        case Opt_discard:
+            dfsb_i->dwarfs_mount_opt |= DWARFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            dfsb_i->dwarfs_mount_opt &= ~DWARFS_MOUNT_DISCARD;
+            break;
+        default:
+            printk("Dwarfs: unrecognised mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int dwarfs_show_options(struct seq_file *seq, struct dentry *root) {
+    struct super_block *sb = root->d_sb;
+
+    if(dwarfs_test_opt(sb, DWARFS_MOUNT_DELALLOC))
+        seq_puts(seq, ",delalloc");
+    if(dwarfs_test_opt(sb, DWARFS_MOUNT_DISCARD))
+        seq_puts(seq, ",discard");
+    return 0;
+}
+
 /* Generate the Superblock when mounting the filesystem */
 int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
 
@@ -79,7 +143,7 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
     uint64_t logical_sb_blocknum;
     uint64_t offset = 0;
     unsigned long blocksize;
-    int i;
+    int err;
     printk("Dwarfs: fill_super\n");
 
     dfsb_i = kzalloc(sizeof(struct dwarfs_superblock_info), GFP_KERNEL);
@@ -91,6 +155,13 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_fs_info = dfsb_i;
     dfsb_i->dwarfs_sb_blocknum = DWARFS_SUPERBLOCK_BLOCKNUM;
 
+    if((err = dwarfs_parse_options(sb, data)))
+        return err;
+    if(dwarfs_test_opt(sb, DWARFS_MOUNT_DISCARD) && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+        printk("Dwarfs: the device doesn't support discard, ignoring the discard option\n");
+        dfsb_i->dwarfs_mount_opt &= ~DWARFS_MOUNT_DISCARD;
+    }
+
     /* 
      * Making sure that the physical disk's block size isn't
      * larger than the filesystem's defined block size.
@@ -125,6 +196,12 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
     }
     else printk("Dwarfs got correct magicnum: 0x%lx\n", sb->s_magic);
 
+    if(le64_to_cpu(dfsb->dwarfs_version_num) != DWARFS_VERSION) {
+        printk("Dwarfs: unsupported on-disk version %llu, expected %lu. Recreate the volume with mkfs.dwarfs\n",
+               le64_to_cpu(dfsb->dwarfs_version_num), DWARFS_VERSION);
+        return -EINVAL;
+    }
+
     if(sb->s_blocksize != blocksize) {
         printk("Dwarfs blocksize mismatch: %lu vs %lu\n", sb->s_blocksize, blocksize);
     }
@@ -138,8 +215,6 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
     dfsb_i->dwarfs_inodesize = sizeof(struct dwarfs_inode);
     dfsb_i->dwarfs_first_inum = DWARFS_FIRST_INODE;
     dfsb_i->dwarfs_inodes_per_block = sb->s_blocksize / dfsb_i->dwarfs_inodesize;
-    dfsb_i->dwarfs_free_inodes_count = dfsb->dwarfs_free_inodes_count;
-    dfsb_i->dwarfs_free_blocks_count = dfsb->dwarfs_free_blocks_count;
     if(dfsb_i->dwarfs_inodes_per_block <= 0) {
         printk("Dwarfs: inodes per block = 0!\n");
         return -EINVAL;
@@ -148,14 +223,33 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_op = &dwarfs_super_operations;
     dfsb_i->dwarfs_bufferhead = bh;
     
-    for(i = 0; i < 30; i++)
-        mutex_init(dfsb_i->dwarfs_bitmap_lock + i);
     mutex_init(&dfsb_i->dwarfs_inode_bitmap_lock);
+    dfsb_i->dwarfs_inode_cursor = DWARFS_FIRST_INODE;
+    dfsb_i->dwarfs_rsv_tree = RB_ROOT;
+    spin_lock_init(&dfsb_i->dwarfs_rsv_lock);
+    atomic64_set(&dfsb_i->dwarfs_delalloc_blocks, 0);
+
+    if((err = dwarfs_init_free_summary(sb))) {
+        printk("Dwarfs: failed to build the free space summary!\n");
+        return err;
+    }
+    if((err = dwarfs_orphan_init(sb))) {
+        dwarfs_destroy_free_summary(sb);
+        return err;
+    }
+    if((err = dwarfs_unwritten_init(sb))) {
+        dwarfs_orphan_destroy(sb);
+        dwarfs_destroy_free_summary(sb);
+        return err;
+    }
 
     root = dwarfs_inode_get(sb, DWARFS_ROOT_INUM);
     
     if(IS_ERR(root)) {
         printk("Dwarfs got error code when getting the root node!\n");
+        dwarfs_unwritten_destroy(sb);
+        dwarfs_orphan_destroy(sb);
+        dwarfs_destroy_free_summary(sb);
         return PTR_ERR(root);
     }
     if(!S_ISDIR(root->i_mode) /* || !root->i_blocks || !root->i_size */) {
@@ -165,6 +259,9 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
 
         iput(root);
         printk("Dwarfs: Root node corrupt!\n");
+        dwarfs_unwritten_destroy(sb);
+        dwarfs_orphan_destroy(sb);
+        dwarfs_destroy_free_summary(sb);
         return -EINVAL;
     }
 
@@ -179,6 +276,8 @@ int dwarfs_fill_super(struct super_block *sb, void *data, int silent) {
         printk("Creating block 0 of root inode\n");
         dwarfs_make_empty_dir(root, root);
     }
+    if(dwarfs_orphan_recover(sb))
+        printk("Dwarfs: some orphan inodes couldn't be reclaimed\n");
     dwarfs_write_super(sb);
     return 0;
 }
@@ -238,10 +337,13 @@ void dwarfs_put_super(struct super_block *sb) {
         printk("s_fs_info is NULL!\n");
         return;
     }	
+    dwarfs_unwritten_destroy(sb);
+    dwarfs_orphan_destroy(sb);
     dwarfsb = dwarfsb_i->dfsb;
     if(dwarfsb) {
         dwarfs_superblock_sync(sb, dwarfsb, 1);
     }
+    dwarfs_destroy_free_summary(sb);
     sb->s_fs_info = NULL;
     kfree(dwarfsb_i);
     printk("DwarFS superblock destroyed successfully.\n");
@@ -251,6 +353,7 @@ static int dwarfs_statfs(struct dentry *dentry, struct kstatfs *stat) {
     struct super_block *sb = dentry->d_sb;
     struct dwarfs_superblock_info *dfsb_i = DWARFS_SB(sb);
     struct dwarfs_superblock *dfsb = dfsb_i->dfsb;
+    uint64_t freeblocks, freeinodes;
 
     stat->f_type = DWARFS_MAGIC;
     stat->f_bsize = sb->s_blocksize;
@@ -258,10 +361,12 @@ static int dwarfs_statfs(struct dentry *dentry, struct kstatfs *stat) {
     stat->f_files = dfsb->dwarfs_inodec;
     stat->f_namelen = DWARFS_MAX_FILENAME_LEN;
 
-    stat->f_bfree = dfsb_i->dwarfs_free_blocks_count;
-    dfsb->dwarfs_free_blocks_count = dfsb_i->dwarfs_free_blocks_count;
-    stat->f_ffree = dfsb_i->dwarfs_free_inodes_count;
-    dfsb->dwarfs_free_inodes_count = dfsb_i->dwarfs_free_inodes_count;
+    freeblocks = percpu_counter_sum_positive(&dfsb_i->dwarfs_free_blocks_count);
+    freeinodes = percpu_counter_sum_positive(&dfsb_i->dwarfs_free_inodes_count);
+    stat->f_bfree = freeblocks - min_t(uint64_t, atomic64_read(&dfsb_i->dwarfs_delalloc_blocks), freeblocks);
+    dfsb->dwarfs_free_blocks_count = freeblocks;
+    stat->f_ffree = freeinodes;
+    dfsb->dwarfs_free_inodes_count = freeinodes;
     stat->f_bavail = stat->f_bfree;
 
     /* Seems like even the guys writing the manual pages don't know wtf f_fsid is supposed to be, so ignoring.... */
@@ -277,6 +382,7 @@ struct super_operations const dwarfs_super_operations = {
     .write_inode    = dwarfs_iwrite,
     .sync_fs        = dwarfs_sync_fs,
     .statfs         = dwarfs_statfs,
+    .show_options   = dwarfs_show_options,
 };
 
 module_init(dwarfs_init);